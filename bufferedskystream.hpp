@@ -1,9 +1,15 @@
+#include <atomic>
+#include <exception>
 #include <functional>
 #include <thread>
 #include <map>
+#include <memory>
 #include <unordered_set>
 
+#include "priorityheap.hpp"
 #include "skystream.hpp"
+#include "slice.hpp"
+#include "spool.hpp"
 
 // we added rading/writing conditions to wait on in net pumps.
 // they have a small race problem because a shared variable is not used.
@@ -23,21 +29,56 @@ class bufferedskystreams
 {
 friend class bufferedskystream;
 public:
-	bufferedskystreams(sia::portalpool & portalpool, size_t maxblocksize = 1024*1024*128, std::function<void(bufferedskystream&,uint64_t)> down_callback = {}, std::function<void(bufferedskystream&,uint64_t)> up_callback = {})
+	// threads is the size of the pool shared by all streams to start and verify downloads, 0 for one per core.
+	// pumps_down and pumps_up are how many streams are pumped at once in each direction,
+	// pumps_up = 0 for one per upload worker in the portalpool.
+	bufferedskystreams(sia::portalpool & portalpool, size_t maxblocksize = 1024*1024*128, std::function<void(bufferedskystream&,uint64_t)> down_callback = {}, std::function<void(bufferedskystream&,uint64_t)> up_callback = {}, size_t threads = 0, size_t pumps_down = 1, size_t pumps_up = 0)
 	: portalpool(portalpool),
-	  maxblocksize(maxblocksize)
+	  maxblocksize(maxblocksize),
+	  smallestblocksize(maxblocksize),
+	  minblocksize(0),
+	  linger(0),
+	  batchstreams(64),
+	  upbudget(maxblocksize * 8),
+	  queuedup(0),
+	  tickets(0),
+	  serving(0),
+	  tasks(threads)
 	{
+		if (pumps_up == 0) {
+			pumps_up = std::max((size_t)1, portalpool.workers_up());
+		}
 		pumping = true;
-		down_thread = std::thread(&bufferedskystreams::pump_down, this);
-		up_thread = std::thread(&bufferedskystreams::pump_up, this);
+		for (size_t pump = 0; pump < std::max((size_t)1, pumps_down); ++ pump) {
+			down_threads.emplace_back(&bufferedskystreams::pump_down, this);
+		}
+		for (size_t pump = 0; pump < pumps_up; ++ pump) {
+			up_threads.emplace_back(&bufferedskystreams::pump_up, this);
+		}
 	}
 	~bufferedskystreams()
 	{
 		shutdown();
+		// the spool's slices call back into budget_mutex, which goes before leftovers would
+		leftovers.clear();
 	}
 	void shutdown();
 
 	size_t add(nlohmann::json identifiers = {});
+	// adds a stream for each of identifiers, in order, returning the index of the first.  opening a stream
+	// downloads its tail metadata, so they are opened in parallel, as many at once as the portal pool has
+	// download workers.  a stream whose tail metadata is given in metadata, not null, downloads nothing.
+	// lazily, each is kept as just its identifiers and opened by the first get() of it, or by open_all(), instead.
+	size_t add_all(std::vector<nlohmann::json> const & identifiers, std::vector<nlohmann::json> const & metadata = {}, bool lazily = false);
+
+	// opens every stream not open yet, in parallel, as add_all does
+	void open_all();
+
+	// lets go of a stream: its read-ahead is cancelled, and if nothing else holds it, it has nothing left
+	// to upload and no pump is on it, it is closed down to its tail's identifiers and metadata, for the
+	// next get() to open again without downloading.  otherwise it is only trimmed back to its tail, the
+	// metadata of earlier blocks found while reading it let go.  a stream that is not open is left alone.
+	void evict(size_t index);
 
 	void set_down_callback(std::function<void(bufferedskystream&,uint64_t)> callback)
 	{
@@ -51,48 +92,236 @@ public:
 		up_callback = callback;
 	}
 
+	// called once for each upload, with every stream it carried and the bytes it sent of each,
+	// after up_callback has been called for them
+	using uploadbatch = std::vector<std::pair<bufferedskystream*,uint64_t>>;
+	void set_up_batch_callback(std::function<void(uploadbatch const &)> callback)
+	{
+		std::scoped_lock lock(streams_mutex);
+		up_batch_callback = callback;
+	}
+
 	size_t size()
 	{
 		std::scoped_lock lock(streams_mutex);
 		return streams.size();
 	}
 
-	bufferedskystream & get(size_t index)
+	// opens the stream first if it was added lazily or evicted.  the stream stays open while the handle is held.
+	std::shared_ptr<bufferedskystream> get(size_t index)
 	{
-		std::scoped_lock lock(streams_mutex);
-		return *streams[index];
+		while ("opening") {
+			{
+				std::scoped_lock lock(streams_mutex);
+				if (streams[index]) {
+					return streams[index];
+				}
+			}
+			open({index});
+		}
+	}
+
+	// the tail's identifiers and metadata of a stream, as skystream::tail_json gives them, without opening it
+	nlohmann::json tail_json(size_t index);
+
+	// bytes that may be queued for upload across all streams at once, 0 for no limit.
+	// defaults to 8 blocks.  producers wait for room in the order they arrived.
+	void set_up_budget(uint64_t bytes)
+	{
+		{
+			std::scoped_lock lock(budget_mutex);
+			upbudget = bytes;
+		}
+		budget_freed.notify_all();
+	}
+
+	// queued upload data is kept in files under directory instead of memory, in segments of segmentsize
+	// shared by all streams, so producers can run ahead of the network by as much disk as they are given.
+	// bytes becomes the upload budget, and the per-stream queue limit is lifted.  set before queueing.
+	// a file stays until every slice of it is uploaded, so the files on disk count against the budget
+	// too, and use no more than bytes and the segment being filled.
+	// the files journal what each stream queued and how far it was uploaded, so if the process dies,
+	// the next group spooling to directory moves each stream, as it is opened or now, to the last tail
+	// it uploaded, and queues the rest of what it had again.
+	void set_up_spool(std::string directory, uint64_t bytes, size_t segmentsize = 1024*1024*64);
+
+	// bytes queued or being uploaded, across all streams
+	uint64_t queued_up()
+	{
+		std::scoped_lock lock(budget_mutex);
+		return queuedup;
+	}
+
+	// bytes that could be queued now without waiting for the budget
+	uint64_t capacity_up()
+	{
+		std::scoped_lock lock(budget_mutex);
+		if (!upbudget) {
+			return ~(uint64_t)0;
+		}
+		if (tickets != serving || spent_up()) {
+			return 0;
+		}
+		return upbudget - std::max(queuedup, spooled_up());
+	}
+
+	// like nagle's algorithm, a stream is not uploaded until it has minblocksize bytes queued,
+	// unless its oldest queued bytes have waited for linger, the group is shutting down, or
+	// producers are waiting on the upload budget.  minblocksize = 0 uploads whatever is queued.
+	void set_up_batching(size_t minblocksize, std::chrono::milliseconds linger)
+	{
+		{
+			std::scoped_lock lock(up_priorities_mutex);
+			this->minblocksize = minblocksize;
+			this->linger = linger;
+		}
+		up_new.notify_all();
+	}
+
+	// ready blocks of up to this many streams are sent together as one multi-file upload,
+	// as long as they fit in maxblocksize.  1 uploads each stream's blocks on their own.
+	void set_up_batchstreams(size_t streams)
+	{
+		std::scoped_lock lock(up_priorities_mutex);
+		batchstreams = std::max((size_t)1, streams);
+	}
+
+	// lets each stream size its upload blocks between smallest and maxblocksize from how
+	// transfers are going: big enough that latency is a small part of each upload, small
+	// enough that a failed one is cheap to retry.  smallest = maxblocksize fixes the size.
+	// streams already open start over from smallest if they have not measured an upload yet.
+	void set_up_blocksize(size_t smallest);
+
+	// download and verification tasks waiting for a thread
+	size_t queued_tasks()
+	{
+		return tasks.queued();
+	}
+
+	size_t task_threads()
+	{
+		return tasks.size();
 	}
 
 private:
-	bool pumping;
+	std::atomic<bool> pumping; // read by pumps under their priorities mutex, so not behind streams_mutex
 	std::mutex streams_mutex;
-	std::vector<std::unique_ptr<bufferedskystream>> streams;
+	std::mutex adding_mutex; // streams are opened outside streams_mutex, but one call at a time
 	sia::portalpool & portalpool;
 	size_t maxblocksize;
+	size_t smallestblocksize;
+	size_t minblocksize;
+	std::chrono::milliseconds linger;
+	size_t batchstreams;
+	std::unique_ptr<sia::spool> spool; // null to queue in memory
+	std::map<size_t, sia::spool::leftover> leftovers; // by index, what the spool recovered for streams not yet opened
+	std::map<size_t, std::pair<nlohmann::json, nlohmann::json>> unopened; // by index, identifiers and any known tail metadata of streams not open
+
+	// opens those of the streams at indices that are not open yet, in parallel
+	void open(std::vector<size_t> const & indices);
+
+	// bytes of the spool's files on disk
+	uint64_t spooled_up()
+	{
+		return spool ? spool->ondisk() : 0;
+	}
+	// whether the budget is used up, by bytes queued or spooled, with budget_mutex held
+	bool spent_up()
+	{
+		return queuedup >= upbudget || spooled_up() >= upbudget;
+	}
+	// takes up to size bytes of the upload budget, waiting in turn until some is free
+	uint64_t reserve_up(uint64_t size)
+	{
+		std::unique_lock lock(budget_mutex);
+		if (!upbudget) {
+			queuedup += size;
+			return size;
+		}
+		uint64_t ticket = tickets ++;
+		if (ticket != serving || spent_up()) {
+			// lingering streams are uploaded to make room
+			lock.unlock();
+			{
+				std::scoped_lock priorities_lock(up_priorities_mutex);
+			}
+			up_new.notify_all();
+			lock.lock();
+		}
+		while (ticket != serving || spent_up()) {
+			budget_freed.wait(lock);
+		}
+		size = std::min(size, upbudget - queuedup);
+		queuedup += size;
+		++ serving;
+		lock.unlock();
+		budget_freed.notify_all();
+		return size;
+	}
+	// takes size bytes of the upload budget only if nobody is waiting and they are free now
+	bool try_reserve_up(uint64_t size)
+	{
+		std::scoped_lock lock(budget_mutex);
+		if (upbudget && (tickets != serving || queuedup + size > upbudget || spooled_up() >= upbudget)) {
+			return false;
+		}
+		queuedup += size;
+		return true;
+	}
+	// takes size bytes of the upload budget at once, even past it, for data queued from an earlier run
+	void hold_up(uint64_t size)
+	{
+		std::scoped_lock lock(budget_mutex);
+		queuedup += size;
+	}
+	void release_up(uint64_t size)
+	{
+		{
+			std::scoped_lock lock(budget_mutex);
+			queuedup -= size;
+		}
+		budget_freed.notify_all();
+	}
+	std::mutex budget_mutex;
+	std::condition_variable budget_freed;
+	uint64_t upbudget, queuedup;
+	uint64_t tickets, serving; // producers are let through in order
+
+	taskpool tasks; // declared before streams, whose downloaders wait on it when destroyed
+	std::vector<std::shared_ptr<bufferedskystream>> streams; // null where not open; pumps hold what they work on
 
 	std::condition_variable down_new;
 	std::condition_variable up_new;
-	std::multimap<uint64_t,bufferedskystream*,std::greater<uint64_t>> down_priorities;
-	std::multimap<uint64_t,bufferedskystream*,std::greater<uint64_t>> up_priorities;
+	priorityheap<bufferedskystream> down_priorities;
+	priorityheap<bufferedskystream> up_priorities;
+	priorityheap<bufferedskystream> up_lingering; // earliest due first
 	std::mutex down_priorities_mutex;
 	std::mutex up_priorities_mutex;
 
-	std::thread down_thread;
-	std::thread up_thread;
+	std::vector<std::thread> down_threads;
+	std::vector<std::thread> up_threads;
 	std::function<void(bufferedskystream&,uint64_t)> up_callback, down_callback;
+	std::function<void(uploadbatch const &)> up_batch_callback;
 
 	void pump_down();
 	void pump_up();
+	bufferedskystream * ready_up(std::chrono::steady_clock::time_point & due);
+	size_t blocksize_up(double throughput);
 };
 
-class bufferedskystream : public skystream
+class bufferedskystream : public skystream, public std::enable_shared_from_this<bufferedskystream>
 {
+friend class bufferedskystreams;
 public:
-	bufferedskystream(bufferedskystreams & group, size_t index = 0, nlohmann::json identifiers = {})
-	: skystream(group.portalpool, identifiers),
+	bufferedskystream(bufferedskystreams & group, size_t index = 0, nlohmann::json identifiers = {}, nlohmann::json metadata = {})
+	: skystream(group.portalpool, identifiers, metadata),
 	  group(group),
-	  _index(index)
+	  _index(index),
+	  downhook(this),
+	  uphook(this),
+	  lingerhook(this)
 	{
+		tasks = &group.tasks;
 		start();
 	}
 
@@ -106,7 +335,8 @@ public:
 
 	~bufferedskystream()
 	{
-		if (backlogup()) {
+		// a spool keeps what is left, for the next run to pick up
+		if (backlogup() && !spool) {
 			std::cerr << "not flushed" << std::endl;
 			exit(-1);
 		}
@@ -153,14 +383,21 @@ public:
 		uploaded = offsetup;
 	}
 
+	// the vector is adopted into the queue rather than copied
 	void queue_local_up(std::vector<uint8_t> && data)
+	{
+		queue_local_up(sia::slice(std::move(data)));
+	}
+	// blocks while this stream's queue is full, or the group's upload budget is spent
+	void queue_local_up(sia::slice data)
 	{
 		size_t uploaded = 0;
 		while (uploaded < data.size()) {
-			size_t toupload = data.size() - uploaded;
+			size_t reserved = group.reserve_up(data.size() - uploaded);
+			size_t toupload = reserved;
 			{
-				std::unique_lock lock(group.up_priorities_mutex);
-				if (group.maxblocksize > 0) {
+				std::unique_lock lock(mutex);
+				if (group.maxblocksize > 0 && !spool) {
 					while (queueup.size() >= group.maxblocksize*2) {
 						this->uploaded.wait(lock);
 					}
@@ -168,41 +405,78 @@ public:
 						toupload = group.maxblocksize*2 - queueup.size() ;
 					}
 				}
-				{
-					std::unique_lock lock(mutex);
-					tailup += toupload;
-				}
-				queueup.insert(queueup.end(), data.begin() + uploaded, data.begin() + uploaded + toupload);
-				if (queueup.size() != uppriority) {
-					for (auto range = group.up_priorities.equal_range(uppriority); range.first != range.second; ++range.first) {
-						if (range.first->second == this) {
-							group.up_priorities.erase(range.first);
-							break;
-						}
-					}
-					uppriority = queueup.size();
-				}
-				assert(uppriority);
-				auto spot = group.up_priorities.emplace(uppriority, this);
-				if (spot == group.up_priorities.begin()) {
-					lock.unlock();
-					group.up_new.notify_all();
-				}
+				push_up(toupload == data.size() ? std::move(data) : data.sub(uploaded, toupload));
+			}
+			if (toupload < reserved) {
+				group.release_up(reserved - toupload);
 			}
 			uploaded += toupload;
 		}
 	}
 
+	// bytes and blocks that may be downloaded past a read, while reads are sequential
+	void set_readahead(uint64_t bytes, size_t blocks)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		readaheadbytes = bytes;
+		readaheadblocks = blocks;
+		readahead = std::min(readahead, bytes);
+	}
 
-	// pumps one transfer cycle for downloads, returns bytes pumped or -1 if shut down
+	// the size upload blocks are currently cut to
+	size_t blocksize_up()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return upblocksize;
+	}
+
+	// bytes that could be queued now without blocking
+	uint64_t capacity_up()
+	{
+		uint64_t capacity = group.capacity_up();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (group.maxblocksize > 0 && !spool) {
+			capacity = std::min(capacity, group.maxblocksize*2 > queueup.size() ? group.maxblocksize*2 - queueup.size() : 0);
+		}
+		return capacity;
+	}
+
+	// queues all of data if that can be done without blocking, otherwise leaves it and returns false
+	bool try_queue_local_up(std::vector<uint8_t> && data)
+	{
+		if (!group.try_reserve_up(data.size())) {
+			return false;
+		}
+		std::unique_lock lock(mutex);
+		if (group.maxblocksize > 0 && !spool && queueup.size() + data.size() > group.maxblocksize*2) {
+			lock.unlock();
+			group.release_up(data.size());
+			return false;
+		}
+		push_up(sia::slice(std::move(data)));
+		return true;
+	}
+
+
+	// pumps one transfer cycle for downloads, returns bytes pumped or -1 if shut down.
+	// blocks already queued are skipped, and at most readaheadblocks are queued past the one being read.
 	ssize_t queue_net_down()
 	{
 		size_t offset = 0;
 		size_t tail = 0;
-		{ // get current request
+		size_t queued = 0;
+		size_t blocks = 0;
+		bool needed = false;
+		{ // get current request, past what is already queued
 			std::unique_lock<std::mutex> lock(mutex);
 			offset = offsetdown;
 			tail = taildown;
+			for (auto it = queuedown.find(offset); it != queuedown.end(); it = queuedown.find(offset)) {
+				offset = it->second->tail;
+			}
+			needed = offset == offsetdown;
+			queued = queuedown.size();
+			blocks = readaheadblocks;
 		}
 		{ // check for shutdown
 			std::unique_lock<std::mutex> lock(mutex);
@@ -224,30 +498,36 @@ public:
 
 			// The first reason this is slow appears to be the time spent downloading the tree in the block_span call.  This call would be avoided by downloading by index instead of by bytes.
 
-			// start by waiting for at least one
-			while (0 == (worker = portalpool.takeworkerout(sia::skynet_multiportal::download, false))) {
-				std::unique_lock<std::mutex> lock(portalpool.worker_lists);
-				portalpool.worker_free.wait(lock);
+			// start by waiting for at least one, if the reader is waiting on it
+			if (needed) {
+				while (0 == (worker = portalpool.takeworkerout(sia::skynet_multiportal::download, false))) {
+					std::unique_lock<std::mutex> lock(portalpool.worker_lists);
+					portalpool.worker_free.wait(lock);
+				}
+				auto range = block_span("bytes", offset, worker);
+				auto d = new downloader(*this, worker, range.first, range.second);
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					queuedown[range.first] = std::unique_ptr<downloader>(d);
+				}
+				worker = 0;
+				offset = range.second;
+				++ queued;
 			}
-			auto range = block_span("bytes", offset, worker);
-			auto d = new downloader(*this, worker, range.first, range.second);
-			{
-				std::unique_lock<std::mutex> lock(mutex);
-				queuedown[range.first] = std::unique_ptr<downloader>(d);
-			}
-			worker = 0;
-			offset = range.second;
-			// then add more if there are free workers
-			while ((worker = portalpool.takeworkerout(sia::skynet_multiportal::download, false))) {
-				range = block_span("bytes", offset, worker);
-				d = new downloader(*this, worker, range.first, range.second);
+			// then read ahead if there are free workers
+			while (offset < tail && queued <= blocks) {
+				auto range = block_span("bytes", offset);
+				if (!(worker = portalpool.takeworkerout(sia::skynet_multiportal::download, false))) {
+					break;
+				}
+				auto d = new downloader(*this, worker, range.first, range.second);
 				{
 					std::unique_lock<std::mutex> lock(mutex);
 					queuedown[range.first] = std::unique_ptr<downloader>(d);
 				}
 				worker = 0;
 				offset = range.second;
-				range = block_span("bytes", offset);
+				++ queued;
 			}
 		} catch (std::out_of_range&) { } // thrown at end of stream
 				// note workers and calls to block_span
@@ -264,6 +544,11 @@ public:
 
 	std::mutex read_mutex;
 	std::vector<uint8_t> xfer_local_down(uint64_t offset, uint64_t size = 0, int64_t eventualtail = -1)
+	{
+		return sia::slicequeue::join(xfer_local_down_slices(offset, size, eventualtail));
+	}
+	// like xfer_local_down, but returns the downloaded buffers themselves rather than a copy
+	std::vector<sia::slice> xfer_local_down_slices(uint64_t offset, uint64_t size = 0, int64_t eventualtail = -1)
 	{
 		if (eventualtail == -1) {
 			eventualtail = span("bytes").second;
@@ -274,17 +559,20 @@ public:
 		std::lock_guard<std::mutex> read_lock(read_mutex);
 		{
 			std::unique_lock<std::mutex> lock(mutex);
-			taildown = eventualtail;
+			// the read-ahead window doubles while reads follow on from each other, and closes on a seek
+			if (offset == readend) {
+				readahead = std::min(std::max(readahead * 2, size), readaheadbytes);
+			} else {
+				readahead = 0;
+			}
+			readend = offset + size;
+			taildown = std::min((uint64_t)eventualtail, offset + size + readahead);
 			// remove queued items outside expected range
+			// in-flight transfers are cancelled, returning their workers right away
 			for (auto it = queuedown.begin(); it != queuedown.end();) {
-				// for now this mutex waits for completion
-				// ideally there would be a way to cancel skynet txs
-				// we could also move it to some other list
-				std::unique_lock lock(it->second->mutex);
-				if (it->first > taildown || it->first + it->second->data.size() < offset) {
-					auto backup = std::move(it->second);
+				if (it->first > taildown || it->second->tail < offset) {
+					it->second->cancel();
 					it = queuedown.erase(it);
-					lock.unlock();
 				} else {
 					++ it;
 				}
@@ -299,53 +587,69 @@ public:
 			while (pumping && queuedown.count(offsetdown) == 0) {
 				{
 					std::unique_lock lock(group.down_priorities_mutex);
-					for(auto range = group.down_priorities.equal_range(downpriority); range.first != range.second; ++range.first) {
-						if (range.first->second == this) {
-							group.down_priorities.erase(range.first);
-							break;
-						}
-					}
-					downpriority = taildown - offsetdown;
-					auto spot = group.down_priorities.emplace(downpriority,this);
-					if (spot == group.down_priorities.begin()) {
+					if (prioritize_down(taildown - offsetdown)) {
 						lock.unlock();
 						group.down_new.notify_all();
 					}
 				}
 				moredatadown.wait(lock);
 			}
-			std::vector<uint8_t> result;
+			std::vector<sia::slice> result;
 			while (queuedown.count(offsetdown)) {
 				auto & itemr = queuedown[offsetdown];
-				std::scoped_lock(itemr->mutex);
+				itemr->wait();
+				size_t skip = offset > offsetdown ? offset - offsetdown : 0;
 				if (offset + size < offsetdown + itemr->data.size()) {
-					// request ends before block does
-					if (offsetdown < offset) {
-						result.insert(result.end(), itemr->data.begin() + offset - offsetdown, itemr->data.begin() + offset + size - offsetdown);
-					} else {
-						result.insert(result.end(), itemr->data.begin(), itemr->data.begin() + offset + size - offsetdown);
-					}
+					// request ends before block does, so the block stays queued
+					result.emplace_back(itemr->data.sub(skip, offset + size - offsetdown - skip));
 					return result;
 				}
 				auto item = std::move(itemr);
 				queuedown.erase(offsetdown);
-				auto itembegin = item->data.begin();
-				if (offset > offsetdown) {
-					itembegin += offset - offsetdown;
-				}
-				result.insert(result.end(), itembegin, item->data.end());
-				//std::cerr << "Ferrying " << (item->data.end() - itembegin) << " bytes" << std::endl;
+				result.emplace_back(item->data.sub(skip));
 				offsetdown += item->data.size();
 			}
 			return result;
 		}
 	}
 
+	// stop streaming downloads, cancelling any in flight
+	void cancel_down()
+	{
+		std::lock_guard<std::mutex> read_lock(read_mutex);
+		std::unique_lock<std::mutex> lock(mutex);
+		taildown = offsetdown;
+		for (auto & item : queuedown) {
+			item.second->cancel();
+		}
+		queuedown.clear();
+		std::unique_lock priorities_lock(group.down_priorities_mutex);
+		prioritize_down(0);
+	}
+
 	// pump one transfer cycle for uploads, return bytes pumped or -1 if shut down
 	ssize_t xfer_net_up()
 	{
-		std::vector<uint8_t> data;
+		std::vector<sia::slice> data;
 		size_t offset;
+		ssize_t size = take_net_up(data, offset);
+		if (size > 0) {
+			double seconds;
+			try {
+				seconds = write(data, "bytes", offset);
+			} catch (std::runtime_error const & error) {
+				std::cerr << "bytes " << offset << ": " << error.what() << std::endl;
+				unsent_net_up(std::move(data));
+				return 0;
+			}
+			sent_net_up(size, size, seconds);
+		}
+		return size;
+	}
+
+	// takes the next block to upload and where it goes, returning its size, 0 if there is none or -1 if shut down
+	ssize_t take_net_up(std::vector<sia::slice> & data, size_t & offset)
+	{
 		{
 			std::unique_lock<std::mutex> lock(mutex);
 			if (!pumping) {
@@ -359,38 +663,45 @@ public:
 			}
 			offset = offsetup;
 		}
-		// pull data to transfer into local variable
+		// pull data to transfer into local variable, sharing the queued buffers
+		size_t size = 0;
 		{
-			std::unique_lock lock(group.up_priorities_mutex);
-			if (group.maxblocksize <= 0 || queueup.size() <= group.maxblocksize) {
-				data = std::move(queueup);
-			} else {
-				data.insert(data.begin(), queueup.begin(), queueup.begin() + group.maxblocksize);
-				queueup.erase(queueup.begin(), queueup.begin() + group.maxblocksize);
-			}
+			std::unique_lock<std::mutex> lock(mutex);
+			data = queueup.take(upblocksize > 0 ? upblocksize : queueup.size());
 		}
-		if (data.size()) {
-			write(data, "bytes", offset);
-			{
-				std::lock_guard<std::mutex> lock(mutex);
-				offsetup += data.size();
-			}
-			uploaded.notify_all();
+		for (auto & chunk : data) {
+			size += chunk.size();
 		}
+		return size;
+	}
+
+	// puts a block taken by take_net_up back at the front of the queue, as it could not be written
+	void unsent_net_up(std::vector<sia::slice> && data)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queueup.untake(std::move(data));
+	}
+
+	// records a block taken by take_net_up as written.  it went up in an upload of batchsize bytes taking seconds,
+	// which is what throughput is measured from, as the stream's blocks travel in batches of that size.
+	void sent_net_up(size_t size, size_t batchsize, double seconds)
+	{
+		size_t blocksize = group.blocksize_up(measure_up(batchsize, seconds));
+		sia::spool * spool;
+		uint64_t offset;
 		{
-			std::unique_lock lock(group.up_priorities_mutex);
-			if (queueup.size() == 0) {
-				assert(uppriority != 0); // logic flow with queue_local_up.  i thought it could be good to have only nonzero priorities in the queue, ever.
-				for (auto range = group.up_priorities.equal_range(uppriority); range.first != range.second; ++range.first) {
-					if (range.first->second == this) {
-						group.up_priorities.erase(range.first);
-						break;
-					}
-				}
-				uppriority = 0;
-			}
+			std::lock_guard<std::mutex> lock(mutex);
+			offsetup += size;
+			upblocksize = blocksize;
+			spool = this->spool;
+			offset = offsetup;
+		}
+		// journaled while the block's spooled bytes are still held
+		if (spool) {
+			spool->sent(_index, offset, identifiers());
 		}
-		return data.size();
+		group.release_up(size);
+		uploaded.notify_all();
 	}
 
 	std::mutex mutex;
@@ -402,111 +713,489 @@ private:
 	struct downloader
 	{
 		bufferedskystream & stream;
-		std::thread process;
 		size_t start;
 		size_t tail;
+		bool done;
 		std::condition_variable downloaded;
-		std::vector<uint8_t> data;
+		sia::slice data;
 		std::mutex mutex;
 
 		downloader(bufferedskystream & stream, sia::portalpool::worker const * worker, size_t node_start, size_t node_end)
-		: stream(stream), worker(worker)
+		: stream(stream), done(false), worker(worker), cancelled(std::make_shared<sia::cancellation>())
 		{
 			std::unique_lock<std::mutex> lock(stream.mutex);
 			start = node_start;
 			tail = node_end;
 			//std::cerr << "Downloading " << start << " to " << tail << std::endl;
-			process = std::thread(&downloader::download, this, std::move(std::unique_lock(mutex)));
+			stream.group.tasks.submit(std::bind(&downloader::download, this));
 		}
 		~downloader()
 		{
-			process.join();
+			wait();
+		}
+		// aborts the transfer, to be destroyed without waiting for it
+		void cancel()
+		{
+			cancelled->cancel();
+		}
+		// blocks until the transfer has completed
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!done) {
+				downloaded.wait(lock);
+			}
 		}
 	private:
-		void download(std::unique_lock<std::mutex> && lock)
+		void download()
 		{
 			double offset = start;
-			data = stream.skystream::read("bytes", offset, "real", worker);
+			try {
+				stream.skystream::read("bytes", offset, std::bind(&downloader::downloaded_data, this, std::placeholders::_1), "real", worker, cancelled);
+			} catch (std::exception const & e) {
+				std::cerr << "bytes " << start << ": " << e.what() << std::endl;
+				downloaded_data({});
+			}
+		}
+		void downloaded_data(sia::slice result)
+		{
+			auto & stream = this->stream;
 			stream.portalpool.putworkerback(worker);
-			worker = 0;
-			//std::cerr << "notifying " << start << std::endl;
-			lock.unlock();
-			downloaded.notify_all();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				data = std::move(result);
+				worker = 0;
+				done = true;
+				//std::cerr << "notifying " << start << std::endl;
+				downloaded.notify_all();
+			}
 			stream.moredatadown.notify_all();
 		}
 		sia::portalpool::worker const * worker;
+		sia::canceltoken cancelled;
 	};
+	// starts keeping queued upload data in the group's spool
+	void spool_up(sia::spool * spool)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		this->spool = spool;
+	}
+
+	// folds an upload into this stream's throughput, returning the new average in bytes/second.
+	// seconds is the engine's time on the transfer, after connecting, so latency is already out of it,
+	// as it is accounted for separately when sizing blocks.
+	double measure_up(size_t size, double seconds)
+	{
+		constexpr double weight = 0.25;
+		double throughput = size / std::max(seconds, 0.001);
+		std::lock_guard<std::mutex> lock(mutex);
+		upthroughput = upthroughput > 0 ? upthroughput * (1 - weight) + throughput * weight : throughput;
+		return upthroughput;
+	}
+
+	// carries on from an earlier run's spool: moves to the tail it last uploaded, if that is further
+	// than the stream was opened at, and queues again what it had spooled past there
+	void resume_up(sia::spool::leftover left)
+	{
+		if (!left.identifiers.empty() && left.offset > processedup()) {
+			set_tail(left.identifiers);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (offsetup != tailup) {
+			throw std::runtime_error("resuming a stream with uploads already queued");
+		}
+		offsetup = span("bytes").second;
+		tailup = offsetup;
+		uint64_t resumed = 0;
+		for (auto & part : left.queued) {
+			// only what follows on from the tail; past a gap nothing can be placed
+			if (part.first > offsetup + resumed) {
+				break;
+			}
+			if (part.first + part.second.size() > offsetup + resumed) {
+				resumed += part.first + part.second.size() - offsetup - resumed;
+			}
+		}
+		if (!resumed) {
+			return;
+		}
+		// taken before the bytes are queued, as the pumps give it back when they are sent
+		group.hold_up(resumed);
+		for (auto & part : left.queued) {
+			if (part.first + part.second.size() > tailup && part.first <= tailup) {
+				push_up(part.second.sub(tailup - part.first), true);
+			}
+		}
+	}
+
+	// appends to the upload queue, with the stream's mutex held.  inspool is for data that is in the spool already.
+	void push_up(sia::slice data, bool inspool = false)
+	{
+		uint64_t offset = tailup;
+		tailup += data.size();
+		if (spool && !inspool) {
+			for (auto & part : spool->append(data, _index, offset)) {
+				queueup.push(std::move(part));
+			}
+		} else {
+			queueup.push(std::move(data));
+		}
+		std::unique_lock priorities_lock(group.up_priorities_mutex);
+		if (prioritize_up(queueup.size())) {
+			priorities_lock.unlock();
+			group.up_new.notify_all();
+		}
+	}
+
+	// these place the stream in the group's priorities, with that direction's priorities mutex held.
+	// a stream being pumped is kept out, so only one pump works on it at once and its data stays in order;
+	// its pump puts it back afterwards.  returns true if the stream became the neediest.
+	bool prioritize_up(uint64_t priority)
+	{
+		if (priority == 0 || uppumping) {
+			group.up_priorities.erase(uphook);
+			group.up_lingering.erase(lingerhook);
+			return false;
+		}
+		if (!group.up_lingering.contains(lingerhook)) {
+			// the linger deadline runs from when data arrives in an idle queue
+			updue = std::chrono::steady_clock::now() + group.linger;
+			group.up_lingering.push(lingerhook, ~(uint64_t)0 - updue.time_since_epoch().count());
+		}
+		return group.up_priorities.push(uphook, priority);
+	}
+	bool prioritize_down(uint64_t priority)
+	{
+		downpriority = priority;
+		if (priority == 0 || downpumping) {
+			group.down_priorities.erase(downhook);
+			return false;
+		}
+		return group.down_priorities.push(downhook, priority);
+	}
+
 	void start()
 	{
 		std::lock_guard<std::mutex> lock(mutex);
+		upblocksize = group.smallestblocksize;
+		upthroughput = 0;
 		offsetup = span("bytes").second;
 		tailup = offsetup;
 		offsetdown = 0;
 		taildown = 0;
+		readend = 0;
+		readahead = 0;
 		downpriority = 0;
-		uppriority = 0;
 	}
 	bufferedskystreams & group;
 	size_t const _index;
 	bool pumping = true;
 	std::map<size_t, std::unique_ptr<downloader>> queuedown;
-	std::vector<uint8_t> queueup;
+	sia::slicequeue queueup;
+	sia::spool * spool = nullptr; // holds queueup's data if the group spools
 	size_t offsetdown, taildown;
+	uint64_t readend, readahead; // where the last read ended, and how far past a read to download
+	uint64_t readaheadbytes = 1024*1024*64;
+	size_t readaheadblocks = 8;
 	size_t offsetup, tailup;
+	size_t upblocksize;
+	double upthroughput;
 	uint64_t downpriority;
-	uint64_t uppriority;
+	priorityheap<bufferedskystream>::hook downhook, uphook, lingerhook;
+	std::chrono::steady_clock::time_point updue;
+	bool downpumping = false, uppumping = false;
 };
 
 
 void bufferedskystreams::shutdown()
 {
+	std::vector<std::shared_ptr<bufferedskystream>> open;
 	{
 		std::scoped_lock lock(streams_mutex);
 		pumping = false;
 		for (auto & stream : streams) {
-			stream->shutdown();
+			if (stream) {
+				open.push_back(stream);
+			}
 		}
 	}
+	// not under streams_mutex, as producers hold a stream's mutex while they take other locks
+	for (auto & stream : open) {
+		stream->shutdown();
+	}
+	// pumps check pumping under their priorities mutex before they wait, so they see it or are woken
+	{
+		std::scoped_lock lock(down_priorities_mutex);
+	}
 	down_new.notify_all();
+	{
+		std::scoped_lock lock(up_priorities_mutex);
+	}
 	up_new.notify_all();
-	if (down_thread.joinable()) {
-		down_thread.join();
+	for (auto & thread : down_threads) {
+		if (thread.joinable()) {
+			thread.join();
+		}
 	}
-	if (up_thread.joinable()) {
-		up_thread.join();
+	for (auto & thread : up_threads) {
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+	// nothing more uploads, so what the spool still holds stays on disk as the streams let go of it
+	std::scoped_lock lock(streams_mutex);
+	if (spool) {
+		spool->keep();
 	}
 }
 
 size_t bufferedskystreams::add(nlohmann::json identifiers)
 {
-	std::scoped_lock lock(streams_mutex);
-	streams.emplace_back(new bufferedskystream(*this, streams.size(), identifiers));
-	if (!pumping) { streams.back()->shutdown(); }
-	return streams.size() - 1;
+	return add_all({identifiers});
+}
+
+size_t bufferedskystreams::add_all(std::vector<nlohmann::json> const & identifiers, std::vector<nlohmann::json> const & metadata, bool lazily)
+{
+	size_t first;
+	std::vector<size_t> indices;
+	{
+		std::scoped_lock lock(streams_mutex);
+		first = streams.size();
+		for (size_t index = 0; index < identifiers.size(); ++ index) {
+			streams.emplace_back();
+			unopened[first + index] = {identifiers[index], index < metadata.size() ? metadata[index] : nlohmann::json()};
+			indices.push_back(first + index);
+		}
+	}
+	if (!lazily) {
+		open(indices);
+	}
+	return first;
+}
+
+void bufferedskystreams::open_all()
+{
+	std::vector<size_t> indices;
+	{
+		std::scoped_lock lock(streams_mutex);
+		for (auto & closed : unopened) {
+			indices.push_back(closed.first);
+		}
+	}
+	open(indices);
+}
+
+void bufferedskystreams::open(std::vector<size_t> const & indices)
+{
+	std::scoped_lock adding(adding_mutex);
+	std::vector<std::pair<size_t, std::pair<nlohmann::json, nlohmann::json>>> closed;
+	{
+		std::scoped_lock lock(streams_mutex);
+		for (auto index : indices) {
+			auto found = unopened.find(index);
+			if (found != unopened.end()) {
+				closed.emplace_back(index, found->second);
+			}
+		}
+	}
+	std::vector<std::unique_ptr<bufferedskystream>> opened(closed.size());
+	std::atomic<size_t> next(0);
+	std::exception_ptr failure;
+	std::mutex failure_mutex;
+	auto open = [&]() {
+		for (size_t index = next ++; index < opened.size(); index = next ++) {
+			try {
+				opened[index].reset(new bufferedskystream(*this, closed[index].first, closed[index].second.first, closed[index].second.second));
+			} catch (...) {
+				std::scoped_lock lock(failure_mutex);
+				failure = std::current_exception();
+				next = opened.size();
+			}
+		}
+	};
+	std::vector<std::thread> openers;
+	size_t threads = std::min(opened.size(), std::max((size_t)1, portalpool.workers_down()));
+	for (size_t thread = 1; thread < threads; ++ thread) {
+		openers.emplace_back(open);
+	}
+	open();
+	for (auto & opener : openers) {
+		opener.join();
+	}
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+
+	std::vector<std::pair<std::shared_ptr<bufferedskystream>, sia::spool::leftover>> resuming;
+	{
+		std::scoped_lock lock(streams_mutex);
+		for (auto & opening : opened) {
+			std::shared_ptr<bufferedskystream> stream = std::move(opening);
+			// nothing else holds the new stream's mutex yet, so it may be taken here
+			if (spool) {
+				stream->spool_up(spool.get());
+			}
+			if (!pumping) { stream->shutdown(); }
+			auto leftover = leftovers.find(stream->index());
+			if (leftover != leftovers.end()) {
+				resuming.emplace_back(stream, std::move(leftover->second));
+				leftovers.erase(leftover);
+			}
+			unopened.erase(stream->index());
+			streams[stream->index()] = stream;
+		}
+	}
+	// not under streams_mutex, as resuming queues data
+	for (auto & leftover : resuming) {
+		leftover.first->resume_up(std::move(leftover.second));
+	}
+}
+
+void bufferedskystreams::evict(size_t index)
+{
+	std::shared_ptr<bufferedskystream> stream;
+	{
+		std::scoped_lock lock(streams_mutex);
+		stream = streams[index];
+	}
+	if (!stream) {
+		return;
+	}
+	stream->cancel_down();
+	stream->drop_cache();
+
+	// with its mutex held and nothing queued, no upload can start, so its tail stays put
+	nlohmann::json tail;
+	uint64_t offset;
+	{
+		std::scoped_lock stream_lock(stream->mutex);
+		if (stream->tailup != stream->offsetup) {
+			return;
+		}
+		{
+			std::scoped_lock lock(up_priorities_mutex);
+			if (stream->uppumping) {
+				return;
+			}
+		}
+		{
+			std::scoped_lock lock(down_priorities_mutex);
+			if (stream->downpumping || down_priorities.contains(stream->downhook) || !stream->queuedown.empty()) {
+				return;
+			}
+		}
+		tail = stream->tail_json();
+		offset = stream->offsetup;
+	}
+
+	// its mutex is let go before streams_mutex, so it is checked again here.  with no other handle, none to be
+	// taken while streams_mutex is held, and no pump on it or able to pick it, nothing can change it now.
+	std::scoped_lock lock(up_priorities_mutex, down_priorities_mutex, streams_mutex);
+	if (stream.use_count() > 2 || stream->uppumping || stream->downpumping) {
+		return;
+	}
+	if (up_priorities.contains(stream->uphook) || down_priorities.contains(stream->downhook) || !stream->queuedown.empty()) {
+		return;
+	}
+	if (stream->tailup != offset || stream->offsetup != offset) {
+		return;
+	}
+	unopened[index] = {tail["identifiers"], tail["metadata"]};
+	streams[index].reset();
+	// the stream goes when this last handle does, after the locks are let go
+}
+
+nlohmann::json bufferedskystreams::tail_json(size_t index)
+{
+	std::shared_ptr<bufferedskystream> stream;
+	{
+		std::scoped_lock lock(streams_mutex);
+		stream = streams[index];
+		if (!stream) {
+			auto & closed = unopened[index];
+			return {{"identifiers", closed.first}, {"metadata", closed.second}};
+		}
+	}
+	return stream->tail_json();
+}
+
+void bufferedskystreams::set_up_spool(std::string directory, uint64_t bytes, size_t segmentsize)
+{
+	if (mkdir(directory.c_str(), 0755) == -1 && errno != EEXIST) {
+		throw std::runtime_error(directory + ": " + strerror(errno));
+	}
+	std::vector<std::shared_ptr<bufferedskystream>> existing;
+	std::vector<std::pair<std::shared_ptr<bufferedskystream>, sia::spool::leftover>> resuming;
+	{
+		std::scoped_lock lock(streams_mutex);
+		if (spool) {
+			throw std::runtime_error("already spooling to " + directory);
+		}
+		spool.reset(new sia::spool(directory + "/spool", segmentsize));
+		// producers may be waiting for a file to go
+		spool->set_freed_callback([this]() {
+			{
+				std::scoped_lock lock(budget_mutex);
+			}
+			budget_freed.notify_all();
+		});
+		leftovers = spool->leftovers();
+		for (auto & stream : streams) {
+			if (!stream) {
+				continue;
+			}
+			existing.push_back(stream);
+			auto leftover = leftovers.find(stream->index());
+			if (leftover != leftovers.end()) {
+				resuming.emplace_back(stream, std::move(leftover->second));
+				leftovers.erase(leftover);
+			}
+		}
+	}
+	set_up_budget(bytes);
+	// not under streams_mutex, which a pump may wait on while a producer holds a stream's mutex
+	for (auto & stream : existing) {
+		stream->spool_up(spool.get());
+	}
+	if (resuming.size()) {
+		std::cerr << "Resuming spooled uploads of " << resuming.size() << " streams from " << directory << std::endl;
+	}
+	for (auto & leftover : resuming) {
+		leftover.first->resume_up(std::move(leftover.second));
+	}
 }
 
 void bufferedskystreams::pump_down()
 {
 	bufferedskystream * stream;
+	std::shared_ptr<bufferedskystream> holding; // so it is not evicted while pumped
 	
 	while("pumping") {
+		holding.reset();
 		{
 			std::unique_lock lock(down_priorities_mutex);
-			if (down_priorities.size() == 0) {
-				{
-					std::scoped_lock lock(streams_mutex);
-					if (!pumping) {
-						return;
-					}
+			if (down_priorities.empty()) {
+				if (!pumping) {
+					return;
 				}
 				down_new.wait(lock);
 				continue;
 			}
-			stream = down_priorities.begin()->second;
-			// TODO: erase this next line, and have queue_net_down do it like in pump_up
-			down_priorities.erase(down_priorities.begin());
+			// the reader puts it back when it needs more
+			stream = down_priorities.pop();
+			holding = stream->shared_from_this();
+			stream->downpumping = true;
+			stream->downpriority = 0;
 		}
 		ssize_t size = stream->queue_net_down();
+		{
+			std::unique_lock lock(down_priorities_mutex);
+			stream->downpumping = false;
+			if (stream->prioritize_down(stream->downpriority)) {
+				lock.unlock();
+				down_new.notify_all();
+			}
+		}
 		if (size > 0) {
 			if (down_callback) {
 				down_callback(*stream, size);
@@ -514,32 +1203,177 @@ void bufferedskystreams::pump_down()
 		}
 	}
 }
+void bufferedskystreams::set_up_blocksize(size_t smallest)
+{
+	std::vector<std::shared_ptr<bufferedskystream>> existing;
+	{
+		std::scoped_lock lock(streams_mutex);
+		smallestblocksize = std::min(smallest, maxblocksize);
+		smallest = smallestblocksize;
+		for (auto & stream : streams) {
+			if (stream) {
+				existing.push_back(stream);
+			}
+		}
+	}
+	// not under streams_mutex, which a pump may wait on while a producer holds a stream's mutex
+	for (auto & stream : existing) {
+		std::scoped_lock lock(stream->mutex);
+		if (stream->upthroughput > 0) {
+			stream->upblocksize = std::clamp(stream->upblocksize, smallest, maxblocksize);
+		} else {
+			stream->upblocksize = smallest;
+		}
+	}
+}
+
+// the block size for a stream uploading at throughput bytes/second
+size_t bufferedskystreams::blocksize_up(double throughput)
+{
+	size_t smallest;
+	{
+		std::scoped_lock lock(streams_mutex);
+		smallest = smallestblocksize;
+	}
+	if (smallest >= maxblocksize || maxblocksize == 0) {
+		return maxblocksize;
+	}
+	auto overall = portalpool.overall_stats(sia::skynet_multiportal::upload);
+	double failurerate = overall.failures / double(overall.successes + overall.failures + 1);
+	// latency at most a tenth of each upload, and a failure wasting at most half a minute
+	double seconds = std::max(overall.latency * 9, 1.0);
+	seconds = std::min(seconds, 30 * (1 - failurerate));
+	double size = throughput * seconds;
+	if (size <= smallest) {
+		return smallest;
+	}
+	if (size >= maxblocksize) {
+		return maxblocksize;
+	}
+	return size;
+}
+
+// the stream to upload next, with up_priorities_mutex held, or null and when to look again
+bufferedskystream * bufferedskystreams::ready_up(std::chrono::steady_clock::time_point & due)
+{
+	auto stream = up_priorities.top();
+	if (stream->uphook.priority >= minblocksize) {
+		return stream;
+	}
+	if (!pumping) {
+		return stream;
+	}
+	{
+		std::scoped_lock lock(budget_mutex);
+		if (tickets != serving) {
+			return stream;
+		}
+	}
+	stream = up_lingering.top();
+	due = stream->updue;
+	if (due <= std::chrono::steady_clock::now()) {
+		return stream;
+	}
+	return nullptr;
+}
 void bufferedskystreams::pump_up()
 {
 	bufferedskystream * stream;
-	decltype(up_priorities)::iterator streamit;
+	std::vector<bufferedskystream *> batch;
+	std::vector<std::shared_ptr<bufferedskystream>> holding; // so none is evicted before the callbacks are done
 
 	while("pumping") {
+		batch.clear();
+		holding.clear();
 		{
 			std::unique_lock lock(up_priorities_mutex);
-			if (up_priorities.size() == 0) {
-				{
-					std::scoped_lock lock(streams_mutex);
-					if (!pumping) {
-						break;
-					}
+			if (up_priorities.empty()) {
+				if (!pumping) {
+					break;
 				}
 				up_new.wait(lock);
 				continue;
 			}
-			streamit = up_priorities.begin();
-			stream = streamit->second;
+			std::chrono::steady_clock::time_point due;
+			stream = ready_up(due);
+			if (!stream) {
+				up_new.wait_until(lock, due);
+				continue;
+			}
+			// other ready streams come along, so many small blocks share one round trip
+			uint64_t batchsize = 0;
+			while (stream) {
+				batchsize += std::min(stream->uphook.priority, (uint64_t)maxblocksize);
+				up_priorities.erase(stream->uphook);
+				up_lingering.erase(stream->lingerhook);
+				stream->uppumping = true;
+				batch.push_back(stream);
+				holding.push_back(stream->shared_from_this());
+				if (batch.size() >= batchstreams || up_priorities.empty()) {
+					break;
+				}
+				stream = ready_up(due);
+				if (stream && batchsize + std::min(stream->uphook.priority, (uint64_t)maxblocksize) > maxblocksize) {
+					break;
+				}
+			}
 		}
-		ssize_t size = stream->xfer_net_up(); // empties itself from up_priorities
-		if (size > 0) {
-			if (up_callback) {
-				up_callback(*stream, size);
+		std::vector<ssize_t> sizes(batch.size());
+		if (batch.size() == 1) {
+			sizes[0] = batch[0]->xfer_net_up();
+		} else {
+			std::vector<skystream::pendingwrite> writes;
+			std::vector<std::vector<sia::slice>> taken(batch.size());
+			size_t batchsize = 0;
+			for (size_t index = 0; index < batch.size(); ++ index) {
+				size_t offset;
+				sizes[index] = batch[index]->take_net_up(taken[index], offset);
+				if (sizes[index] > 0) {
+					writes.emplace_back(batch[index]->prepare_write(taken[index], "bytes", offset));
+					batchsize += sizes[index];
+				}
+			}
+			double seconds = 0;
+			try {
+				seconds = skystream::write(writes);
+			} catch (std::runtime_error const & error) {
+				// the streams are put back with their blocks, to go up again
+				std::cerr << error.what() << std::endl;
+				writes.clear();
+				for (size_t index = 0; index < batch.size(); ++ index) {
+					if (sizes[index] > 0) {
+						batch[index]->unsent_net_up(std::move(taken[index]));
+						sizes[index] = 0;
+					}
+				}
 			}
+			for (size_t index = 0; index < batch.size(); ++ index) {
+				if (sizes[index] > 0) {
+					batch[index]->sent_net_up(sizes[index], batchsize, seconds);
+				}
+			}
+		}
+		uploadbatch sent;
+		for (size_t index = 0; index < batch.size(); ++ index) {
+			stream = batch[index];
+			{
+				std::unique_lock stream_lock(stream->mutex);
+				std::unique_lock lock(up_priorities_mutex);
+				stream->uppumping = false;
+				if (stream->prioritize_up(stream->queueup.size())) {
+					lock.unlock();
+					up_new.notify_all();
+				}
+			}
+			if (sizes[index] > 0) {
+				if (up_callback) {
+					up_callback(*stream, sizes[index]);
+				}
+				sent.emplace_back(stream, sizes[index]);
+			}
+		}
+		if (sent.size() && up_batch_callback) {
+			up_batch_callback(sent);
 		}
 	}
 }
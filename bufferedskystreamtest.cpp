@@ -39,7 +39,7 @@ int main(int argc, char **argv)
 	}
 
 	std::cerr << "Finding responsive mirrors ..." << std::endl;
-	sia::portalpool pool;
+	sia::portalpool pool(1024, 1024, 8, 4, 60, "portals.json");
 	uint64_t offset = 0;
 	if (options.count("offset")) {
 		offset = std::stoull(options["offset"]);
@@ -71,9 +71,9 @@ int main(int argc, char **argv)
 			std::cerr << "No --down=, assuming " << options["down"] << std::endl;
 		}
 		streams.add(file2json(options["down"]));
-		auto & stream = streams.get(0);
+		auto stream = streams.get(0);
 
-		auto range = stream.span("bytes");
+		auto range = stream->span("bytes");
 		if (range.first > offset) {
 			offset = range.first;
 		}
@@ -88,21 +88,24 @@ int main(int argc, char **argv)
 	                std::cerr << "Finished queuing download of " << size << " bytes" << std::endl;
 		});
 		while (offset < end) {
-			auto data = stream.xfer_local_down(offset, 0, end);
+			size_t downloaded = 0;
+			for (auto & data : stream->xfer_local_down_slices(offset, 0, end)) {
+				size_t suboffset = 0;
+				while (suboffset < data.size()) {
+					ssize_t size = write(1, data.data() + suboffset, data.size() - suboffset);
+					if (size < 0) {
+						perror("write");
+						return size;
+					}
+					suboffset += size;
+				}
+				downloaded += data.size();
+			}
 			{
 				std::scoped_lock lock(outputline);
-				std::cerr << "Downloaded " << data.size() << " bytes" << std::endl;
+				std::cerr << "Downloaded " << downloaded << " bytes" << std::endl;
 			}
-			size_t suboffset = 0;
-			while (suboffset < data.size()) {
-				ssize_t size = write(1, data.data() + suboffset, data.size() - suboffset);
-				if (size < 0) {
-					perror("write");
-					return size;
-				}
-				suboffset += size;
-			}
-			offset += data.size();
+			offset += downloaded;
 		}
 		streams.shutdown();
 	} else if (options.count("up")) {
@@ -114,13 +117,11 @@ int main(int argc, char **argv)
 			std::cerr << "No --up=, assuming " << options["up"] << std::endl;
 		}
 		streams.add(file2json(options["up"]));
-		bufferedskystream & stream = streams.get(0);
-		auto range = stream.span("bytes");
+		auto stream = streams.get(0);
+		auto range = stream->span("bytes");
 		double offset = range.second;
 		std::cerr << "Uploading to " << options["up"] << " from stdin starting from " << "bytes" << " " << (uint64_t)offset << std::endl;
-		std::vector<uint8_t> data;
-		data.reserve(1024*1024*16);
-		data.resize(data.capacity());
+		std::vector<uint8_t> data(1024*1024*16);
 		ssize_t size;
 		std::mutex outputline;
 		streams.set_up_callback([&outputline,&options](bufferedskystream&stream, uint64_t size){
@@ -134,14 +135,19 @@ int main(int argc, char **argv)
 				return size;
 			}
 			data.resize(size);
-			stream.queue_local_up(std::move(data));
+			stream->queue_local_up(std::move(data));
 			{
 				std::scoped_lock lock(outputline);
 				std::cerr << "Queued upload of " << size << " bytes" << std::endl;
 			}
 			offset += size;
-			data.resize(data.capacity());
+			// the queue adopted the last buffer
+			data = std::vector<uint8_t>(1024*1024*16);
 		}
 		streams.shutdown();
 	}
+	for (auto & portal : pool.connection_stats()) {
+		auto & stats = portal.second;
+		std::cerr << portal.first << ": " << stats.reused << "/" << stats.transfers << " transfers reused a connection, " << stats.handshakes << " tls handshakes" << std::endl;
+	}
 }
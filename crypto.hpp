@@ -4,6 +4,8 @@
 #include <openssl/evp.h>
 #include <openssl/err.h>
 
+#include "slice.hpp"
+
 class crypto
 {
 public:
@@ -11,26 +13,28 @@ public:
 	{
 		ERR_load_crypto_strings();
 		OpenSSL_add_all_algorithms();
-		mdctx = EVP_MD_CTX_create();
 	}
 	crypto(crypto &&) = default;
 	~crypto()
 	{
-		EVP_MD_CTX_destroy(mdctx);
 		EVP_cleanup();
 		CRYPTO_cleanup_all_ex_data();
 		ERR_free_strings();
 	}
-	std::string digest(std::initializer_list<std::vector<uint8_t> const *> data, decltype(EVP_sha3_512()) algorithm)
+	// data is a list of vector pointers, or of slices
+	template <typename chunks>
+	std::string digest(chunks const & data, decltype(EVP_sha3_512()) algorithm)
 	{
 		static thread_local std::string result;
 		static thread_local std::vector<uint8_t> bytes;
+		static thread_local context local;
+		auto mdctx = local.mdctx;
 		bytes.resize(EVP_MAX_MD_SIZE);
 
 		EVP_DigestInit_ex(mdctx, algorithm, NULL);
 
 		for (auto & chunk : data) {
-			EVP_DigestUpdate(mdctx, chunk->data(), chunk->size());
+			update(mdctx, chunk);
 		}
 
 		unsigned int size;
@@ -49,6 +53,17 @@ public:
 		return result;
 	}
 	nlohmann::json digests(std::initializer_list<std::vector<uint8_t> const *> data)
+	{
+		return alldigests(data);
+	}
+	nlohmann::json digests(std::vector<sia::slice> const & data)
+	{
+		return alldigests(data);
+	}
+
+private:
+	template <typename chunks>
+	nlohmann::json alldigests(chunks const & data)
 	{
 		return {
 #ifndef OPENSSL_NO_BLAKE2
@@ -59,6 +74,20 @@ public:
 		};
 	}
 
-private:
-	EVP_MD_CTX * mdctx;
+	static void update(EVP_MD_CTX * mdctx, std::vector<uint8_t> const * chunk)
+	{
+		EVP_DigestUpdate(mdctx, chunk->data(), chunk->size());
+	}
+	static void update(EVP_MD_CTX * mdctx, sia::slice const & chunk)
+	{
+		EVP_DigestUpdate(mdctx, chunk.data(), chunk.size());
+	}
+
+	// one digest context per thread, so blocks can be verified on many threads at once
+	struct context
+	{
+		context() : mdctx(EVP_MD_CTX_create()) { }
+		~context() { EVP_MD_CTX_destroy(mdctx); }
+		EVP_MD_CTX * mdctx;
+	};
 };
@@ -34,53 +34,61 @@ constexpr unsigned NUMSCOOPS = sizeof(nonce::scoops) / sizeof(nonce::scoop);
 // For sequential reading, the most optimal way to store a plot file is with an entire
 // drive as a single file.
 
-extern "C" {
-
-// from libShabal's autogenerated header file.  some of the file has errors, so just pasted in
-
-/// Creates a single PoC Nonce.
-///
-/// `plot_buffer` must be correct size - no size checks are performed.
-void create_plot(uint64_t account_id,
-                 uint64_t nonce,
-                 uint8_t poc_version,
-                 uint8_t *plot_buffer,
-                 uintptr_t plot_buffer_offset);
-
-}
-
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <random>
 
 #include "bufferedskystream.hpp"
+#include "shabal.hpp"
 #include "tools.hpp"
 
 class Plotfile
 {
 public:
-	Plotfile(uint64_t account, std::string filename)
-	: account(account), _identifiers(file2json(filename)), metastream(portalpool, _identifiers), identifiersfile(filename), scoops(portalpool)
+	// generators is how many threads create nonces, 0 for one per core.
+	// verifysample is the share of nonces uploaded before a restart that are checked, from 0 to 1.
+	// spoolbytes, if not 0, is how much disk generated scoops may wait on, beside filename, rather than in memory.
+	// failed is called, from a background thread, if plotting stops on its own; the owner is to shut it down.
+	Plotfile(uint64_t account, std::string filename, size_t generators = 0, double verifysample = 1.0 / 64, uint64_t spoolbytes = 0, std::function<void()> failed = {})
+	: account(account), portalpool(1024, 1024, 8, 4, 60, filename + ".portals.json"), _identifiers(file2json(filename)), snapshot(loadsnapshot(filename + ".snapshot")), metastream(portalpool, _identifiers, snapshotted(snapshot.value("metastream", nlohmann::json()), _identifiers)), identifiersfile(filename), scoops(portalpool), generatorcount(generators), verifysample(verifysample), spoolbytes(spoolbytes), failed(failed)
 	{
 		_stoppedcount = 0;
 		if (_identifiers.empty()) {
 			std::cerr << "Readying scoop pumps ..." << std::endl;
 			while (scoops.size() < NUMSCOOPS) {
 				size_t index = scoops.add();
-				metadata["scoopstreams"][index] = scoops.get(index).identifiers();
+				metadata["scoopstreams"][index] = scoops.get(index)->identifiers();
 				std::cerr << scoops.size() << "/" << NUMSCOOPS << "\r" << std::flush;
 			}
 			_identifiers = metastream.identifiers();
 		} else {
-			double tailindex = metastream.span("index").second - 1;
-			auto data = metastream.read("index", tailindex);
-			std::string str(data.begin(), data.end());
-			metadata = nlohmann::json::parse(str);
-			std::cerr << "Found metadata document. " << std::endl;
+			if (!snapshotted(snapshot.value("metastream", nlohmann::json()), _identifiers).is_null()) {
+				// the snapshot was taken with the metastream where it is, so its document is at least as new
+				metadata = snapshot["metadata"];
+				snapshotstreams.push_back(NUMSCOOPS);
+				std::cerr << "Found metadata document in local snapshot. " << std::endl;
+			} else {
+				metadata = readmetadata();
+				std::cerr << "Found metadata document. " << std::endl;
+			}
 			std::cerr << "Readying scoop pumps ..." << std::endl;
-			for (auto & identifiers : metadata["scoopstreams"]) {
-				scoops.add(identifiers);
-				std::cerr << scoops.size() << "/" << NUMSCOOPS << "\r" << std::flush;
+			// start() opens the streams: those whose tails the snapshot holds at once, the rest downloading theirs many at once
+			auto identifiers = metadata["scoopstreams"].get<std::vector<nlohmann::json>>();
+			auto tails = snapshot.value("scoopstreams", nlohmann::json::array());
+			std::vector<nlohmann::json> known(identifiers.size());
+			for (size_t index = 0; index < identifiers.size() && index < tails.size(); ++ index) {
+				known[index] = snapshotted(tails[index], identifiers[index]);
+				if (!known[index].is_null()) {
+					snapshotstreams.push_back(index);
+				}
 			}
+			if (snapshotstreams.size()) {
+				std::cerr << "Opening " << snapshotstreams.size() << " streams from " << filename << ".snapshot, to be checked against the network" << std::endl;
+			}
+			scoops.add_all(identifiers, known, true);
 		}
+		snapshot = {};
 		start();
 	}
 
@@ -141,8 +149,8 @@ public:
 		// adjust offset to be relative to scoop start
 		offset -= scoopsindex * scoopssize;
 		if (scoopsindex != lastscoopread) {
-			// terminate streaming for any other scoop
-			scoops.get(lastscoopread).xfer_local_down(0,0,0);
+			// terminate streaming for any other scoop, and let go of what reading it gathered
+			scoops.evict(lastscoopread);
 			lastscoopread = scoopsindex;
 		}
 
@@ -152,82 +160,493 @@ public:
 		}
 
 		// download
-		auto data = scoops.get(scoopsindex).xfer_local_down(offset, size);
-		std::copy(data.begin(), data.end(), buf);
-		return data.size();
+		// copied once, straight from the downloaded blocks
+		size_t copied = 0;
+		for (auto & data : scoops.get(scoopsindex)->xfer_local_down_slices(offset, size)) {
+			std::copy(data.begin(), data.end(), buf + copied);
+			copied += data.size();
+		}
+		return copied;
 	}
 
 	void shutdown()
 	{
 		if (stoppedcount() == 0) {
 			incrementstoppedcount();
+			{
+				std::lock_guard<std::mutex> guard(generated_mutex);
+				generating = false;
+			}
+			generated_ready.notify_all();
+			generated_space.notify_all();
+			{
+				std::lock_guard<std::mutex> guard(verify_mutex);
+				verifying = false;
+			}
+			verifythread.join();
+			reconcilethread.join();
 			scoops.shutdown();
 			scoopsthread.join();
+			for (auto & generator : generators) {
+				generator.join();
+			}
+			{
+				std::lock_guard<std::mutex> scribing(scribe_mutex);
+				if (reconciled) {
+					writesnapshot();
+				}
+			}
 			//metadatathread.join();
 		}
 	}
 
+	// why plotting stopped on its own, empty if it has not
+	std::string failure()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		return _failure;
+	}
+	// whether opening the plot again gets past the failure, as when it was a wrong snapshot, since removed
+	bool restartable()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		return _restartable;
+	}
+
 	uint64_t const account;
 
 private:
 	void start()
 	{
-		// first discern our depth
+		// each scoop grows by only 64 bytes a nonce, so gather a thousand or so per block
+		scoops.set_up_batching(1024 * sizeof(nonce::scoop), std::chrono::minutes(5));
+		scoops.set_up_blocksize(1024 * 1024);
+		// and send the blocks of all the scoops together, as far as they fit in one upload
+		scoops.set_up_batchstreams(4096);
+
+		// generated scoops may wait on disk beside the config rather than in memory, so plotting runs ahead of the uplink.
+		// if the last run stopped with scoops still spooled, the streams pick up its uploads where they were.
+		if (spoolbytes) {
+			scoops.set_up_spool(identifiersfile + ".spool", spoolbytes);
+		}
+
+		// uploads report from here on, waiting on scribe_mutex until the depths below are known, so none is missed
+		std::unique_lock<std::mutex> scribing(scribe_mutex);
+		scoops.set_up_batch_callback(std::bind(&Plotfile::scribeplot, this, std::placeholders::_1));
+
+		// plotting reaches every scoop, so all are opened now, in parallel, rather than one at a time on first use.
+		// any the spool has uploads for resume them as they open
+		scoops.open_all();
+		std::cerr << scoops.size() << "/" << NUMSCOOPS << std::endl;
+
+		// first discern our depth, and how far the scoops are queued
 		depth = -1;
+		uint64_t queueddepth = ~(uint64_t)0;
+		scoopdepths.resize(scoops.size());
 		for (size_t index = 0; index < scoops.size(); ++ index) {
-			auto & scoop = scoops.get(index);
-			int64_t thisdepth = scoop.processedup() / sizeof(nonce::scoop);
+			auto scoop = scoops.get(index);
+			metadata["scoopstreams"][index] = scoop->identifiers();
+			int64_t thisdepth = scoop->processedup() / sizeof(nonce::scoop);
+			scoopdepths[index] = thisdepth;
 			if (depth == -1 || thisdepth < depth) {
 				depth = thisdepth;
 				scoopsonlyatdepth = 1;
 			} else if (thisdepth == depth) {
 				++ scoopsonlyatdepth;
 			}
+			queueddepth = std::min(queueddepth, scoop->sizeup() / sizeof(nonce::scoop));
 		}
 		std::cerr << "Starting noncecount is " << depth << std::endl;
+		if (queueddepth > (uint64_t)depth) {
+			std::cerr << "Nonces up to " << queueddepth << " are still spooled" << std::endl;
+		}
 
+		if (generatorcount == 0) {
+			generatorcount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		generating = true;
+		nextnonce = queueddepth;
+		sentnonce = queueddepth;
+		for (size_t index = 0; index < generatorcount; ++ index) {
+			generators.emplace_back(&Plotfile::generateplot, this);
+		}
+		verifying = true;
+		verifythread = std::thread([this]() {
+			try {
+				verifyplot();
+			} catch (std::runtime_error & error) {
+				fail(std::string("Verifying the plot failed: ") + error.what());
+			}
+		});
+		reconciled = snapshotstreams.empty();
+		reconcilethread = std::thread([this]() {
+			try {
+				reconcileplot();
+			} catch (std::runtime_error & error) {
+				fail(std::string("Reconciling the snapshot failed: ") + error.what());
+			}
+		});
 		scoopsthread = std::thread(&Plotfile::sendplot, this);
 		//metadatathread = std::thread(&Plotfile::scribeplot, this);
-		scoops.set_up_callback(std::bind(&Plotfile::scribeplot, this, std::placeholders::_1, std::placeholders::_2));
 		lastscoopread = 0;
 	}
+	// each generator takes the next nonce numbers, as many as the shabal kernel hashes at once, and
+	// creates them, staying at most two batches a generator ahead of sendplot, so they neither idle nor pile up
+	void generateplot()
+	{
+		size_t lanes = shabal::lanes();
+		std::unique_lock<std::mutex> lock(generated_mutex);
+		while (generating) {
+			if (nextnonce >= sentnonce + generatorcount * lanes * 2) {
+				generated_space.wait(lock);
+				continue;
+			}
+			uint64_t number = nextnonce;
+			nextnonce += lanes;
+			lock.unlock();
+			auto slab = generatedslabs.take();
+			shabal::plot(account, number, lanes, slab->data());
+			lock.lock();
+			generated[number] = sia::slice(std::move(slab), 0, lanes * sizeof(nonce));
+			generated_ready.notify_all();
+		}
+	}
+	// copies the scoops of each nonce into scoop-major runs, so each scoop's run holds it for every nonce in order.
+	// it goes a tile at a time, so what is read and what is written both stay in cache.
+	static void transpose(std::vector<uint8_t const *> const & nonces, uint8_t * runs)
+	{
+		constexpr size_t tilescoops = 64;
+		constexpr size_t tilenonces = 16;
+		size_t count = nonces.size();
+		for (size_t scoopstart = 0; scoopstart < NUMSCOOPS; scoopstart += tilescoops) {
+			for (size_t noncestart = 0; noncestart < count; noncestart += tilenonces) {
+				size_t nonceend = std::min(noncestart + tilenonces, count);
+				for (size_t scoop = scoopstart; scoop < scoopstart + tilescoops; ++ scoop) {
+					for (size_t index = noncestart; index < nonceend; ++ index) {
+						memcpy(runs + (scoop * count + index) * sizeof(nonce::scoop), nonces[index] + scoop * sizeof(nonce::scoop), sizeof(nonce::scoop));
+					}
+				}
+			}
+		}
+	}
+	// takes nonces in order as they are generated, plotbatch at a time, and appends
+	// each scoop's run of them to its stream in one go, from a shared transposed slab.
+	// what a stream holds already is trusted and skipped; verifyplot samples it instead.
 	void sendplot()
 	{
 		std::cerr << "Beginning plot generation thread ..." << std::endl;
 		uint64_t depthup;
 		{
-			std::lock_guard<std::mutex> guard(mutex);
-			depthup = this->depth;
+			std::lock_guard<std::mutex> guard(generated_mutex);
+			depthup = sentnonce;
 		}
-		nonce plotbit;
+		std::vector<sia::slice> plots;
+		std::vector<uint8_t const *> nonces;
 		while (stoppedcount() == 0) {
-			// generate 1 nonce, and append all scoops to stream
-			create_plot(account, depthup, 2, (uint8_t*)&plotbit, 0);
-			
-			// convert to scoops
-			for (size_t index = 0; index < sizeof(plotbit.scoops) / sizeof(nonce::scoop); ++ index) {
-				auto & scoop = plotbit.scoops[index];
-				std::vector<uint8_t> data;
-				data.resize(sizeof(nonce::scoop));
-				std::copy((char*)&scoop,(char*)(&scoop+1),data.data());
-				auto offset = depthup * sizeof(nonce::scoop);
-				// scoops bounds should all be right
-				if (scoops.get(index).sizeup() > offset) {
-					std::vector<uint8_t> compare = scoops.get(index).xfer_local_down(offset, sizeof(nonce::scoop), offset + sizeof(nonce::scoop));
-					if (compare != data) {
-						throw std::runtime_error("existing scoop bytes don't match calculation");
+			plots.clear();
+			nonces.clear();
+			bool stopping;
+			{
+				std::unique_lock<std::mutex> lock(generated_mutex);
+				while (generating && nonces.size() < plotbatch) {
+					auto next = generated.find(depthup + nonces.size());
+					if (next == generated.end()) {
+						generated_ready.wait(lock);
+						continue;
+					}
+					plots.emplace_back(std::move(next->second));
+					generated.erase(next);
+					for (size_t offset = 0; offset < plots.back().size(); offset += sizeof(nonce)) {
+						nonces.push_back(plots.back().data() + offset);
 					}
-				} else {
-					assert(scoops.get(index).sizeup() == offset);
+					sentnonce = depthup + nonces.size();
+					generated_space.notify_all();
+				}
+				stopping = !generating;
+			}
+			if (stopping) {
+				break;
+			}
+			auto slab = transposedslabs.take();
+			transpose(nonces, slab->data());
+			plots.clear();
+
+			size_t runsize = nonces.size() * sizeof(nonce::scoop);
+			uint64_t offset = depthup * sizeof(nonce::scoop);
+			for (size_t index = 0; index < NUMSCOOPS; ++ index) {
+				auto stream = scoops.get(index);
+				sia::slice run(slab, index * runsize, runsize);
+				// scoops bounds should all be right
+				if (stream->sizeup() > offset) {
+					run = run.sub(std::min(stream->sizeup() - offset, (uint64_t)runsize));
+				}
+				if (run.size()) {
+					assert(stream->sizeup() == offset + runsize - run.size());
 					// send data
-					scoops.get(index).queue_local_up(std::move(data));
-					assert(scoops.get(index).sizeup() == offset + sizeof(nonce::scoop));
+					stream->queue_local_up(std::move(run));
+					assert(stream->sizeup() == offset + runsize);
+				}
+			}
+			depthup += nonces.size();
+		}
+	}
+	// stops plotting from a background thread rather than throwing there: nothing more is generated, and the
+	// owner is told, to shut the plot down from its own thread.  only the first reason is kept.
+	void fail(std::string reason, bool restartable = false)
+	{
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			if (_failure.size()) {
+				return;
+			}
+			_failure = reason;
+			_restartable = restartable;
+		}
+		std::cerr << reason << ", stopping" << std::endl;
+		{
+			std::lock_guard<std::mutex> guard(generated_mutex);
+			generating = false;
+		}
+		generated_ready.notify_all();
+		generated_space.notify_all();
+		if (failed) {
+			failed();
+		}
+	}
+	// checks a random sample of the nonces uploaded before this run, past the last verified checkpoint, by creating
+	// them again: verifysample of them, a kernel's worth at a time, each in plotbatch random scoops.  only the
+	// bytes of the sampled nonces are downloaded, and all of a group's reads are in flight together.  a mismatch
+	// stops the plotter, as the plot would be wrong; once all match, the checkpoint moves up to what was uploaded.
+	void verifyplot()
+	{
+		uint64_t verified, top = 0;
+		{
+			std::lock_guard<std::mutex> scribing(scribe_mutex);
+			verified = metadata.value("verified", (uint64_t)0);
+		}
+		std::vector<uint64_t> uploaded(NUMSCOOPS);
+		for (size_t index = 0; index < NUMSCOOPS; ++ index) {
+			uploaded[index] = scoops.get(index)->processedup() / sizeof(nonce::scoop);
+			top = std::max(top, uploaded[index]);
+		}
+		if (top <= verified) {
+			return;
+		}
+		size_t lanes = shabal::lanes();
+		uint64_t groups = (top - verified + lanes - 1) / lanes;
+		uint64_t samples = std::ceil(verifysample * groups);
+		std::cerr << "Verifying " << samples * lanes << " of the " << top - verified << " nonces uploaded since the last checkpoint ..." << std::endl;
+		std::mt19937_64 random(std::random_device{}());
+		std::uniform_int_distribution<uint64_t> randomgroup(0, groups - 1);
+		std::uniform_int_distribution<size_t> randomscoop(0, NUMSCOOPS - 1);
+		std::vector<uint8_t> nonces(lanes * sizeof(nonce));
+		std::vector<std::vector<uint8_t>> expected(plotbatch);
+		for (uint64_t sample = 0; sample < samples; ++ sample) {
+			{
+				std::lock_guard<std::mutex> guard(verify_mutex);
+				if (!verifying) {
+					return;
+				}
+			}
+			uint64_t first = verified + randomgroup(random) * lanes;
+			shabal::plot(account, first, lanes, nonces.data());
+
+			std::mutex checked_mutex;
+			std::condition_variable checked;
+			size_t pending = 0, unread = 0;
+			bool matched = true;
+			for (size_t check = 0; check < plotbatch; ++ check) {
+				size_t index = randomscoop(random);
+				uint64_t end = std::min(first + lanes, uploaded[index]);
+				if (end <= first) {
+					continue;
+				}
+				auto & bytes = expected[check];
+				bytes.resize((end - first) * sizeof(nonce::scoop));
+				for (uint64_t number = first; number < end; ++ number) {
+					memcpy(bytes.data() + (number - first) * sizeof(nonce::scoop), nonces.data() + (number - first) * sizeof(nonce) + index * sizeof(nonce::scoop), sizeof(nonce::scoop));
+				}
+				uint64_t base = first * sizeof(nonce::scoop);
+				double position = base;
+				while (position < base + bytes.size()) {
+					uint64_t start = position;
+					{
+						std::lock_guard<std::mutex> guard(checked_mutex);
+						++ pending;
+					}
+					scoops.get(index)->read_range(position, base + bytes.size() - start, [&, start, base](sia::slice data) {
+						std::lock_guard<std::mutex> guard(checked_mutex);
+						if (data.empty()) {
+							++ unread;
+						} else if (memcmp(data.data(), bytes.data() + (start - base), data.size())) {
+							matched = false;
+						}
+						-- pending;
+						checked.notify_all();
+					});
+				}
+			}
+			{
+				std::unique_lock<std::mutex> lock(checked_mutex);
+				while (pending) {
+					checked.wait(lock);
+				}
+			}
+			if (!matched) {
+				fail("Existing scoop bytes don't match calculation");
+				return;
+			}
+			if (unread) {
+				std::cerr << unread << " sampled scoop reads failed, so nonces past " << verified << " stay unverified" << std::endl;
+				return;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> scribing(scribe_mutex);
+			std::lock_guard<std::mutex> guard(mutex);
+			metadata["verified"] = top;
+		}
+		std::cerr << "Sampled nonces match up to " << top << ", the new verified checkpoint" << std::endl;
+	}
+	// the tails opened from the snapshot are checked against the network in the background, as many at once as
+	// there are download workers.  one that differs means the snapshot is wrong, so it is removed and the plotter
+	// stopped, for its owner to open it again from the network.
+	void reconcileplot()
+	{
+		std::atomic<size_t> next(0);
+		std::atomic<size_t> mismatched(0), checked(0);
+		auto check = [&]() {
+			for (size_t position = next ++; position < snapshotstreams.size(); position = next ++) {
+				{
+					std::lock_guard<std::mutex> guard(verify_mutex);
+					if (!verifying) {
+						return;
+					}
+				}
+				size_t index = snapshotstreams[position];
+				try {
+					bool matches = index == NUMSCOOPS ? metastream.tail_matches() : scoops.get(index)->tail_matches();
+					if (!matches) {
+						++ mismatched;
+					}
+					++ checked;
+				} catch (std::runtime_error & error) {
+					std::cerr << "Checking the snapshot tail of stream " << index << " failed: " << error.what() << std::endl;
 				}
 			}
-			++ depthup;
+		};
+		std::vector<std::thread> checkers;
+		for (size_t thread = 1; thread < portalpool.workers_down(); ++ thread) {
+			checkers.emplace_back(check);
+		}
+		check();
+		for (auto & checker : checkers) {
+			checker.join();
+		}
+		if (mismatched) {
+			unlink((identifiersfile + ".snapshot").c_str());
+			fail(std::to_string(mismatched) + " snapshot tails don't match the network", true);
+			return;
+		}
+		if (checked == snapshotstreams.size()) {
+			std::lock_guard<std::mutex> scribing(scribe_mutex);
+			if (!reconciled) {
+				reconciled = true;
+				std::cerr << "Snapshot tails match the network" << std::endl;
+			}
 		}
 	}
-	void scribeplot(bufferedskystream& lastscoop, uint64_t lastsize)
+	// the metadata document as of the metastream's last record: the checkpoint that record patches, with it and the
+	// patches between applied in order.  a record without a patch is a whole document, as every record once was.
+	nlohmann::json readmetadata()
+	{
+		auto readrecord = [&](uint64_t index, size_t & size) {
+			double offset = index;
+			auto data = metastream.read("index", offset);
+			size = data.size();
+			return nlohmann::json::parse(data.begin(), data.end());
+		};
+		uint64_t tailindex = metastream.span("index").second - 1;
+		size_t size;
+		auto record = readrecord(tailindex, size);
+		if (!record.contains("patch")) {
+			checkpoint = tailindex;
+			checkpointsize = size;
+			patchbytes = 0;
+			written = record;
+			return record;
+		}
+		checkpoint = record["checkpoint"];
+		auto document = readrecord(checkpoint, checkpointsize);
+		patchbytes = 0;
+		for (uint64_t index = checkpoint + 1; index <= tailindex; ++ index) {
+			auto patch = index == tailindex ? record : readrecord(index, size);
+			document = document.patch(patch["patch"]);
+			patchbytes += size;
+		}
+		written = document;
+		return document;
+	}
+	// keeps the tails of the metastream and of every scoop stream, and the metadata document, beside the config,
+	// so a restart can open them without the network.  a line of digests of the rest comes first; it is written
+	// to a temporary file and renamed over the old one.  called with scribe_mutex held.
+	void writesnapshot()
+	{
+		nlohmann::json body;
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			body["metadata"] = metadata;
+		}
+		body["metastream"] = metastream.tail_json();
+		// streams may have uploaded past what the document records; their tails are as real as a spool's journal would make them.
+		// evicted streams are not opened for this
+		for (size_t index = 0; index < scoops.size(); ++ index) {
+			body["scoopstreams"][index] = scoops.tail_json(index);
+			body["metadata"]["scoopstreams"][index] = body["scoopstreams"][index]["identifiers"];
+		}
+		std::string bodystr = body.dump();
+		std::vector<uint8_t> bodybytes(bodystr.begin(), bodystr.end());
+		std::string filename = identifiersfile + ".snapshot";
+		std::ofstream file(filename + ".tmp");
+		if (!file.is_open()) {
+			throw std::runtime_error("Couldn't open " + filename + ".tmp: " + strerror(errno));
+		}
+		file << cryptography.digests({&bodybytes}).dump() << "\n" << bodystr;
+		file.close();
+		if (!file || std::rename((filename + ".tmp").c_str(), filename.c_str()) != 0) {
+			throw std::runtime_error("Couldn't write " + filename + ": " + strerror(errno));
+		}
+	}
+	// the body of a snapshot writesnapshot left, or an empty object if there is none or its digests don't match
+	nlohmann::json loadsnapshot(std::string filename)
+	{
+		std::ifstream file(filename);
+		std::string digests, bodystr;
+		if (!file.is_open() || !std::getline(file, digests)) {
+			return nlohmann::json::object();
+		}
+		std::ostringstream ss;
+		ss << file.rdbuf();
+		bodystr = ss.str();
+		std::vector<uint8_t> bodybytes(bodystr.begin(), bodystr.end());
+		try {
+			if (nlohmann::json::parse(digests) == cryptography.digests({&bodybytes})) {
+				return nlohmann::json::parse(bodystr);
+			}
+		} catch (nlohmann::detail::parse_error&) { }
+		std::cerr << "Ignoring " << filename << ", as its digests don't match" << std::endl;
+		return nlohmann::json::object();
+	}
+	// the tail metadata a snapshot entry holds, if it is of the tail at identifiers, otherwise null
+	static nlohmann::json snapshotted(nlohmann::json const & entry, nlohmann::json const & identifiers)
+	{
+		if (!entry.is_object() || identifiers.empty() || entry.value("identifiers", nlohmann::json()) != identifiers) {
+			return {};
+		}
+		return entry.value("metadata", nlohmann::json());
+	}
+	// records the tails of every scoop an upload carried, in one metastream record for the lot
+	void scribeplot(bufferedskystreams::uploadbatch const & uploads)
 	{
 		// REVIWING FOR BUFFEREDSKYSTREAMS
 		// this looks like the first thing in need of modification
@@ -238,45 +657,72 @@ private:
 		// we keep them all the same, so the shortest ones are pumped.  it unfortunately relise on internal behavior.
 		// but it has the advantage right now of testing that behavior.
 
-		nlohmann::json identifiers;
-		uint64_t uploaded, total;
-		lastscoop.basictipmetadata(identifiers, uploaded, total);
-		metadata["scoopstreams"][lastscoop.index()] = identifiers;
-		int64_t scoopdepth = uploaded / sizeof(nonce::scoop);
-		assert(scoopdepth > depth);
-		-- scoopsonlyatdepth;
+		// several up pumps may finish at once; metadata is appended one at a time
+		std::lock_guard<std::mutex> scribing(scribe_mutex);
 
-		std::cerr << "Extended scoop " << lastscoop.index() << " to " << scoopdepth << " nonces" << std::endl;
+		int64_t scoopdepth;
+		for (auto & upload : uploads) {
+			auto & scoop = *upload.first;
+			nlohmann::json identifiers;
+			uint64_t uploaded, total;
+			scoop.basictipmetadata(identifiers, uploaded, total);
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				metadata["scoopstreams"][scoop.index()] = identifiers;
+			}
+			scoopdepth = uploaded / sizeof(nonce::scoop);
+			// block sizes differ by stream, so a scoop may upload again before the slowest catch up; only leaving the minimum counts
+			if (scoopdepths[scoop.index()] == depth && scoopdepth > depth) {
+				-- scoopsonlyatdepth;
+			}
+			scoopdepths[scoop.index()] = scoopdepth;
+		}
+
+		std::cerr << "Extended " << uploads.size() << " scoops, the last " << uploads.back().first->index() << " to " << scoopdepth << " nonces" << std::endl;
 		std::cerr << scoopsonlyatdepth << " scoops remain to raise noncecount above " << depth << std::endl;
 
 		assert(scoopsonlyatdepth >= 0);
 
-		std::string metadatastr;
+		nlohmann::json document;
 		{
 			std::lock_guard<std::mutex> guard(mutex);
-			metadatastr = metadata.dump();
+			document = metadata;
+		}
+		// an upload changes only the tails of the scoops it carried, so most records are a patch from the last one written
+		uint64_t recordindex = metastream.span("index").second;
+		std::string metadatastr;
+		if (!written.is_null() && recordindex - checkpoint < checkpointevery) {
+			metadatastr = nlohmann::json{{"checkpoint", checkpoint}, {"patch", nlohmann::json::diff(written, document)}}.dump();
+		}
+		bool checkpointing = metadatastr.empty() || patchbytes + metadatastr.size() > checkpointsize;
+		if (checkpointing) {
+			metadatastr = document.dump();
 		}
 		std::vector<uint8_t> metadatabytes(metadatastr.begin(), metadatastr.end());
 		// later, maybe use portalpool with metastream
-		metastream.write(metadatabytes, "bytes", metastream.span("bytes").second);
-		{
-			std::lock_guard<std::mutex> guard(mutex);
-			_identifiers = metastream.identifiers();
-			json2file(_identifiers, identifiersfile);
+		try {
+			metastream.write(std::move(metadatabytes), "bytes", metastream.span("bytes").second);
+			if (checkpointing) {
+				checkpoint = recordindex;
+				checkpointsize = metadatastr.size();
+				patchbytes = 0;
+			} else {
+				patchbytes += metadatastr.size();
+			}
+			written = std::move(document);
+			{
+				std::lock_guard<std::mutex> guard(mutex);
+				_identifiers = metastream.identifiers();
+				json2file(_identifiers, identifiersfile);
+			}
+		} catch (std::runtime_error const & error) {
+			// nothing was written, so the next record carries these tails too
+			std::cerr << "Couldn't record the plot metadata: " << error.what() << std::endl;
 		}
 
 		if (scoopsonlyatdepth == 0) {
-			scoopdepth = depth;
-			for (size_t index = 0; index < scoops.size(); ++ index) {
-				auto & scoop = scoops.get(index);
-				int64_t thisdepth = scoop.processedup() / sizeof(nonce::scoop);
-				if (scoopdepth == depth || thisdepth < scoopdepth) {
-					scoopdepth = thisdepth;
-					scoopsonlyatdepth = 1;
-				} else if (scoopdepth == thisdepth) {
-					++ scoopsonlyatdepth;
-				}
-			}
+			scoopdepth = *std::min_element(scoopdepths.begin(), scoopdepths.end());
+			scoopsonlyatdepth = std::count(scoopdepths.begin(), scoopdepths.end(), scoopdepth);
 			assert(scoopdepth > depth);
 
 			std::cerr << "Updating plotfile to " << scoopdepth << " nonces.  " << scoopsonlyatdepth << " scoops must be extended next." << std::endl;
@@ -285,6 +731,10 @@ private:
 				this->depth = scoopdepth;
 			}
 			std::cerr << "New noncecount: " << depth << std::endl;
+			// a snapshot of unchecked tails could carry a wrong one on, so it waits until they are checked
+			if (reconciled) {
+				writesnapshot();
+			}
 		}
 
 		// this function used to wait on the uploaded cv of the minimum stream.  we didn't know and had two approaches to rewrite, and picked the callback one so that data would be stored immediately after upload; a decision-making metric used in other logging projects.  likely the metric can be merged with other approaches; we need the norm of preserving data, and timestamps are part of data.
@@ -300,19 +750,58 @@ private:
 	// so we could write to nonces or scoops
 	sia::portalpool portalpool;
 	nlohmann::json _identifiers;
+	crypto cryptography;
+	// what the last snapshot held, while starting, and which streams were opened from it, the metastream as NUMSCOOPS
+	nlohmann::json snapshot;
+	std::vector<size_t> snapshotstreams;
 	skystream metastream;
 	nlohmann::json metadata;
+	// records after the first are json patches from the document last written, until a checkpoint writes the whole
+	// of it again: after checkpointevery records, or once the patches since the last would be bigger than it.  a
+	// reader then needs at most checkpointevery records.
+	static constexpr uint64_t checkpointevery = 64;
+	nlohmann::json written; // null until a whole document is due
+	uint64_t checkpoint = 0; // the index of the last whole document
+	size_t checkpointsize = 0, patchbytes = 0;
 	std::string identifiersfile;
 	bufferedskystreams scoops;
 
 	std::thread metadatathread;
 	std::thread scoopsthread;
+
+	// nonces created by the generators, waiting for sendplot to take them in order
+	size_t generatorcount;
+	std::vector<std::thread> generators;
+	std::mutex generated_mutex;
+	std::condition_variable generated_ready, generated_space;
+	std::map<uint64_t, sia::slice> generated; // by the first nonce of each kernel's worth
+	// nonces are sent plotbatch at a time; the slabs for both stages are reused
+	static constexpr size_t plotbatch = 64;
+	sia::slabpool generatedslabs{shabal::lanes() * sizeof(nonce)};
+	sia::slabpool transposedslabs{plotbatch * sizeof(nonce), 4};
+	uint64_t nextnonce, sentnonce;
+	bool generating;
+
+	// nonces uploaded before this run are checked in the background, a sample of them
+	double verifysample;
+	uint64_t spoolbytes; // 0 to queue uploads in memory
+	std::thread verifythread;
+	std::mutex verify_mutex;
+	bool verifying;
+	// and the tails opened from a snapshot are checked against the network; until they are, no new snapshot is taken
+	std::thread reconcilethread;
+	bool reconciled;
 	ssize_t lastscoopread;
 
 	std::mutex mutex;
+	std::mutex scribe_mutex;
 	int _stoppedcount;
+	std::string _failure;
+	bool _restartable = false;
+	std::function<void()> failed;
 	int64_t depth;
 	uint64_t scoopsonlyatdepth;
+	std::vector<int64_t> scoopdepths; // by scoop, the nonces it has uploaded, as of its last report
 	int stoppedcount()
 	{
 		std::lock_guard<std::mutex> guard(mutex);
@@ -334,10 +823,12 @@ private:
 #include <sstream>
 #include <cstdio> // for rename
 #include <cstring>  // for strerror, handling rename's return
+#include <csignal>
+#include <pthread.h>
 class PlotFS : public Fusepp::Fuse<PlotFS>
 {
 public:
-	PlotFS(std::string configfilename)
+	PlotFS(std::string configfilename, uint64_t spoolbytes = 0)
 	{
 		PlotFS::configfilename = configfilename;
 		uint64_t account = std::stoull(configfilename);
@@ -362,7 +853,12 @@ public:
 		char * path = realpath(configfilename.c_str(), 0);
 		configfilename = path;
 		free(path);
-		plotfile = new Plotfile(account, configfilename);
+		// a plot that stops on its own ends fuse's loop the way an interrupt does, in the thread running it, so
+		// main can shut it down and exit
+		pthread_t mainthread = pthread_self();
+		plotfile = new Plotfile(account, configfilename, 0, 1.0 / 64, spoolbytes, [mainthread]() {
+			pthread_kill(mainthread, SIGTERM);
+		});
 	}
 	~PlotFS()
 	{
@@ -460,8 +956,37 @@ int main(int argc, char **argv)
 {
 	if (argc<2) {
 		std::cout << "Provide <accountnum>.json as first argument." << std::endl;
+		std::cout << "--spool=<GiB> lets generated scoops wait for upload in files beside it, rather than in memory." << std::endl;
 		return -1;
 	}
-	PlotFS plotfs(argv[1]);
-	plotfs.run(argc-1, argv+1);
+	// the other arguments are fuse's
+	uint64_t spoolbytes = 0;
+	int kept = 2;
+	for (int arg = 2; arg < argc; ++ arg) {
+		std::string option = argv[arg];
+		if (option.compare(0, 8, "--spool=") == 0) {
+			spoolbytes = std::stoull(option.substr(8)) * 1024 * 1024 * 1024;
+		} else {
+			argv[kept ++] = argv[arg];
+		}
+	}
+	argc = kept;
+	// a plot stopped by a wrong snapshot is opened again, with its tails from the network
+	for (;;) {
+		PlotFS plotfs(argv[1], spoolbytes);
+		int result = 0;
+		if (PlotFS::plotfile->failure().empty()) {
+			result = plotfs.run(argc-1, argv+1);
+		}
+		PlotFS::plotfile->shutdown();
+		std::string failure = PlotFS::plotfile->failure();
+		if (failure.empty()) {
+			return result;
+		}
+		std::cerr << "Plotting stopped: " << failure << std::endl;
+		if (!PlotFS::plotfile->restartable()) {
+			return -1;
+		}
+		std::cerr << "Opening the plot again from the network ..." << std::endl;
+	}
 }
@@ -1,7 +1,11 @@
 #include <siaskynet_multiportal.hpp>
 
+#include <future>
 #include <thread>
 
+#include "transferengine.hpp"
+#include "tools.hpp"
+
 // For outputting a message on stderr when a portal fails
 #include <iostream>
 
@@ -9,9 +13,20 @@ namespace sia {
 
 class portalpool {
 public:
-	portalpool(double bytes_bandwidth_down = 1024, double bytes_bandwidth_up = 1024, size_t connections_down = 8, size_t connections_up = 4)
-	: bandwidth{bytes_bandwidth_down / connections_down, bytes_bandwidth_up / connections_up}
+	// idle connections are kept alive for seconds_idle, enough for every worker to reuse one per portal.
+	// if statsfilename is given, portal measurements are loaded from and saved to it, so that
+	// known-good portals are used from the start.  measurements older than seconds_stale are re-probed.
+	portalpool(double bytes_bandwidth_down = 1024, double bytes_bandwidth_up = 1024, size_t connections_down = 8, size_t connections_up = 4, long seconds_idle = 60, std::string statsfilename = {}, double seconds_stale = 60*60)
+	: bandwidth{bytes_bandwidth_down / connections_down, bytes_bandwidth_up / connections_up},
+	  statsfilename(statsfilename),
+	  seconds_stale(seconds_stale),
+	  engine(2 * (connections_down + connections_up), seconds_idle)
 	{
+		if (statsfilename.size()) {
+			loadstats();
+			probing = true;
+			prober = std::thread(&portalpool::probe, this);
+		}
 		for (size_t i = 0; i < connections_down; ++ i) {
 			workers[skynet_multiportal::download].emplace_back(worker{i, std::unique_ptr<skynet>(new skynet())});
 			free[skynet_multiportal::download].push_back(i);
@@ -22,10 +37,37 @@ public:
 		}
 	}
 
+	~portalpool()
+	{
+		if (prober.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				probing = false;
+			}
+			probe_wake.notify_all();
+			prober.join();
+			savestats();
+		}
+	}
+
+	// what is known about a portal from this and earlier runs
+	struct portalstats {
+		double latency = 0; // seconds to first byte, moving average
+		double throughput = 0; // bytes/second of whole transfers, moving average
+		size_t successes = 0;
+		size_t failures = 0;
+		double measured = 0; // unix time of the last measurement
+		double score() const
+		{
+			return throughput * (successes + 1) / (successes + failures + 1);
+		}
+	};
+
 	struct worker {
 		size_t index;
 		std::unique_ptr<skynet> portal;
 		skynet_multiportal::transfer transfer;
+		std::chrono::steady_clock::time_point started;
 	};
 
 	worker const * takeworkerout(skynet_multiportal::transfer_kind kind, bool block = true)
@@ -42,12 +84,18 @@ public:
 
 	void workstart(worker const * w, skynet_multiportal::transfer_kind kind)
 	{
+		// the transfer stays as the multiportal proposed it, to be ended as such; the worker may use another portal
 		const_cast<worker *>(w)->transfer = multiportal.begin_transfer(kind);
 		const_cast<worker *>(w)->portal->options = w->transfer.portal;
+		const_cast<worker *>(w)->portal->options.url = preferred(kind, w->transfer.portal.url);
+		const_cast<worker *>(w)->started = std::chrono::steady_clock::now();
 	}
 
-	void workstop(worker const * w, size_t size) {
+	// latency is the seconds to first byte, if known.  it is measured against the portal the worker used.
+	void workstop(worker const * w, size_t size, double latency = 0) {
 		multiportal.end_transfer(w->transfer, size);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - w->started).count();
+		measure(w->transfer.kind, w->portal->options.url, size, seconds, latency);
 	}
 
 	void putworkerback(worker const * w) {
@@ -58,68 +106,76 @@ public:
 		worker_free.notify_all();
 	}
 
-	skynet::response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges = {}, size_t maxsize = 1024*1024*64, bool fail = false, worker const * w = 0)
+	// blocking download, a thin wrapper around the asynchronous one
+	skynet::response download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges = {}, size_t maxsize = 1024*1024*64, bool fail = false, worker const * w = 0, canceltoken cancel = {})
+	{
+		std::promise<skynet::response> result;
+		download(skylink, ranges, maxsize, fail, w, [&result](skynet::response && response) {
+			result.set_value(std::move(response));
+		}, cancel);
+		return result.get_future().get();
+	}
+
+	// asynchronous download, done is called from the transfer engine thread.
+	// if cancelled, the transfer is aborted and done is called with an empty response, as it is once every attempt failed.
+	void download(std::string const & skylink, std::initializer_list<std::pair<size_t, size_t>> ranges, size_t maxsize, bool fail, worker const * w, std::function<void(skynet::response &&)> done, canceltoken cancel = {})
 	{
 		auto timeout = std::chrono::milliseconds((unsigned long)(1000 * maxsize / bandwidth[skynet_multiportal::download]));
 
+		std::string range;
+		for (auto & bounds : ranges) {
+			range += (range.size() ? "," : "") + std::to_string(bounds.first) + "-" + std::to_string(bounds.second - 1);
+		}
+		std::string path = skylink.compare(0, 6, "sia://") ? skylink : skylink.substr(6);
+
 		auto worker = w;
-		skynet::response result;
 		if (w == 0) {
 			worker = takeworkerout(skynet_multiportal::download);
 		}
-		while ("retrying download") {
-			try {
-				workstart(worker, skynet_multiportal::download);
-				result = worker->portal->download(skylink, ranges, timeout);
-				workstop(worker, result.data.size() + result.filename.size());
-				break;
-			} catch(std::runtime_error const & e) {
-				workstop(worker, 0);
-				std::cerr << worker->portal->options.url << ": " << e.what() << std::endl;
-				if (fail) {
-					result = {};
-					break;
-				}
+		download_attempt(path, range, timeout, fail, worker, w == 0, std::move(done), std::move(cancel), 0);
+	}
+
+	// a file to upload, sent from its slices without copying them
+	struct file
+	{
+		std::string filename;
+		std::vector<slice> data;
+		std::string contenttype;
+	};
+
+	// blocking upload, a thin wrapper around the asynchronous one.  seconds, if given, is set as done's is.
+	std::string upload(std::string const & filename, std::vector<file> const & files, bool fail = false, worker const * w = 0, double * seconds = 0)
+	{
+		std::promise<std::string> result;
+		upload(filename, files, fail, w, [&result, seconds](std::string && link, double transferred) {
+			if (seconds) {
+				*seconds = transferred;
 			}
-		}
-		if (w == 0) {
-			putworkerback(worker);
-		}
-		return result;
+			result.set_value(std::move(link));
+		});
+		return result.get_future().get();
 	}
 
-	std::string upload(std::string const & filename, std::vector<skynet::upload_data> const & files, bool fail = false, worker const * w = 0)
+	// asynchronous upload, done is called from the transfer engine thread.
+	// the files' buffers are shared until then, as they are reused on retry.  the link is empty if every attempt failed.
+	// with the link come the seconds the engine took sending the upload and getting the response, after connecting,
+	// so neither waiting for a worker nor retrying is counted.
+	void upload(std::string const & filename, std::vector<file> const & files, bool fail, worker const * w, std::function<void(std::string &&, double)> done)
 	{
-		auto worker = w;
 		size_t size = 0;
 		for (auto & file : files) {
-			size += file.data.size() + file.filename.size() + file.contenttype.size();
+			for (auto & chunk : file.data) {
+				size += chunk.size();
+			}
+			size += file.filename.size() + file.contenttype.size();
 		}
 		auto timeout = std::chrono::milliseconds((unsigned long)(1000 * size / bandwidth[skynet_multiportal::upload]));
-		
-		std::string link;
+
+		auto worker = w;
 		if (w == 0) {
 			worker = takeworkerout(skynet_multiportal::upload);
 		}
-		while ("retrying upload") {
-			try {
-				workstart(worker, skynet_multiportal::upload);
-				link = worker->portal->upload(filename, files, timeout);
-				workstop(worker, size);
-				break;
-			} catch(std::runtime_error const & e) {
-				workstop(worker, 0);
-				std::cerr << worker->portal->options.url << ": " << e.what() << std::endl;
-				if (fail) {
-					link = {};
-					break;
-				}
-			}
-		}
-		if (w == 0) {
-			putworkerback(worker);
-		}
-		return link;
+		upload_attempt(filename, files, size, timeout, fail, worker, w == 0, std::move(done), 0);
 	}
 
 	std::mutex worker_lists;
@@ -136,13 +192,275 @@ public:
 		std::unique_lock<std::mutex> lock(worker_lists);
 		return free[skynet_multiportal::upload].size();
 	}
+
+	size_t workers_down()
+	{
+		return workers[skynet_multiportal::download].size();
+	}
+
+	size_t workers_up()
+	{
+		return workers[skynet_multiportal::upload].size();
+	}
+
+	// how often each portal's connections were reused rather than set up anew
+	std::map<std::string, transferengine::connectionstats> connection_stats()
+	{
+		return engine.connection_stats();
+	}
+
+	std::map<std::string, portalstats> portal_stats(skynet_multiportal::transfer_kind kind)
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		return stats[kind];
+	}
+
+	// all portals together: latency and throughput averaged by successes, counts summed
+	portalstats overall_stats(skynet_multiportal::transfer_kind kind)
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		portalstats overall;
+		for (auto & portal : stats[kind]) {
+			auto & measured = portal.second;
+			overall.latency += measured.latency * measured.successes;
+			overall.throughput += measured.throughput * measured.successes;
+			overall.successes += measured.successes;
+			overall.failures += measured.failures;
+			overall.measured = std::max(overall.measured, measured.measured);
+		}
+		if (overall.successes) {
+			overall.latency /= overall.successes;
+			overall.throughput /= overall.successes;
+		}
+		return overall;
+	}
 	
 private:
+	// a failed transfer is tried again, on whichever portal is proposed next, at most this many times in all
+	static constexpr size_t attempts = 8;
+
+	// how long to wait before trying again after attempt failed: doubling from a quarter second, up to half a minute
+	static std::chrono::milliseconds backoff(size_t attempt)
+	{
+		return std::chrono::milliseconds(attempt == 0 ? 0 : std::min(250 << std::min(attempt - 1, (size_t)7), 30000));
+	}
+
+	void download_attempt(std::string path, std::string range, std::chrono::milliseconds timeout, bool fail, worker const * worker, bool ownworker, std::function<void(skynet::response &&)> done, canceltoken cancel, size_t attempt)
+	{
+		workstart(worker, skynet_multiportal::download);
+		engine.get(worker->portal->options.url + "/" + path, range, timeout, [=](transferengine::result && result) {
+			if (result.ok()) {
+				skynet::response response;
+				response.data = std::move(result.data);
+				try {
+					response.filename = nlohmann::json::parse(result.headers["skynet-file-metadata"])["filename"];
+				} catch (nlohmann::json::exception const &) { }
+				workstop(worker, response.data.size() + response.filename.size(), result.seconds_starttransfer);
+				if (ownworker) {
+					putworkerback(worker);
+				}
+				done(std::move(response));
+				return;
+			}
+			if (result.code == CURLE_ABORTED_BY_CALLBACK) {
+				// cancelled or shutting down: neither says anything about the portal
+				multiportal.end_transfer(worker->transfer, 0);
+			} else {
+				workstop(worker, 0);
+				std::cerr << worker->portal->options.url << ": " << result.error << std::endl;
+			}
+			if (fail || result.code == CURLE_ABORTED_BY_CALLBACK || attempt + 1 >= attempts) {
+				if (ownworker) {
+					putworkerback(worker);
+				}
+				done({});
+				return;
+			}
+			download_attempt(path, range, timeout, fail, worker, ownworker, done, cancel, attempt + 1);
+		}, cancel, backoff(attempt));
+	}
+
+	void upload_attempt(std::string filename, std::vector<file> files, size_t size, std::chrono::milliseconds timeout, bool fail, worker const * worker, bool ownworker, std::function<void(std::string &&, double)> done, size_t attempt)
+	{
+		std::vector<transferengine::part> parts;
+		for (auto & file : files) {
+			parts.emplace_back(transferengine::part{files.size() > 1 ? "files[]" : "file", file.filename, file.data, file.contenttype});
+		}
+		workstart(worker, skynet_multiportal::upload);
+		auto url = worker->portal->options.url + "/skynet/skyfile";
+		if (files.size() > 1) {
+			url += "?filename=" + filename;
+		}
+		engine.post(url, parts, timeout, [=](transferengine::result && result) {
+			std::string link;
+			if (result.ok()) {
+				try {
+					link = "sia://" + nlohmann::json::parse(result.data.begin(), result.data.end())["skylink"].get<std::string>();
+				} catch (nlohmann::json::exception const & e) {
+					result.error = e.what();
+				}
+			}
+			if (link.size()) {
+				workstop(worker, size, result.seconds_pretransfer);
+			} else if (result.code == CURLE_ABORTED_BY_CALLBACK) {
+				// cancelled or shutting down: neither says anything about the portal
+				multiportal.end_transfer(worker->transfer, 0);
+			} else {
+				workstop(worker, 0);
+				std::cerr << worker->portal->options.url << ": " << result.error << std::endl;
+				if (!fail && attempt + 1 < attempts) {
+					upload_attempt(filename, files, size, timeout, fail, worker, ownworker, done, attempt + 1);
+					return;
+				}
+			}
+			if (ownworker) {
+				putworkerback(worker);
+			}
+			done(std::move(link), result.seconds - result.seconds_pretransfer);
+		}, {}, backoff(attempt));
+	}
+
+	// the portal to use instead of the one proposed by the multiportal.
+	// a proposed portal is replaced if measurements show it to be much worse than others,
+	// or if nothing is known about it while the multiportal is still warming up.
+	std::string preferred(skynet_multiportal::transfer_kind kind, std::string const & proposed)
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		auto & known = stats[kind];
+		double best = 0;
+		for (auto & portal : known) {
+			best = std::max(best, portal.second.score());
+		}
+		auto proposal = known.find(proposed);
+		bool warming = started[kind] ++ < 4 * workers[kind].size();
+		if (best == 0 || (proposal == known.end() && !warming) || (proposal != known.end() && proposal->second.score() * 4 >= best)) {
+			return proposed;
+		}
+		// spread the load over the good portals in turn
+		std::vector<std::string> good;
+		for (auto & portal : known) {
+			if (portal.second.score() * 2 >= best) {
+				good.push_back(portal.first);
+			}
+		}
+		return good[(next_preferred[kind] ++) % good.size()];
+	}
+
+	void measure(skynet_multiportal::transfer_kind kind, std::string const & url, size_t size, double seconds, double latency)
+	{
+		constexpr double weight = 0.25;
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		auto & portal = stats[kind][url];
+		if (size == 0) {
+			++ portal.failures;
+		} else {
+			double throughput = size / std::max(seconds, 0.001);
+			portal.throughput = portal.successes ? portal.throughput * (1 - weight) + throughput * weight : throughput;
+			portal.latency = portal.successes ? portal.latency * (1 - weight) + latency * weight : latency;
+			++ portal.successes;
+		}
+		portal.measured = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// background thread to re-measure stale portals and save what is known
+	void probe()
+	{
+		std::unique_lock<std::mutex> lock(stats_mutex);
+		while (probing) {
+			double now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+			std::vector<std::pair<skynet_multiportal::transfer_kind, std::string>> stale;
+			for (auto kind : {skynet_multiportal::download, skynet_multiportal::upload}) {
+				for (auto & portal : stats[kind]) {
+					if (now - portal.second.measured > seconds_stale) {
+						stale.emplace_back(kind, portal.first);
+					}
+				}
+			}
+			lock.unlock();
+			for (auto & portal : stale) {
+				auto kind = portal.first;
+				auto url = portal.second;
+				// any http response shows the portal is up, and how quickly it answers
+				engine.get(url, "", std::chrono::seconds(30), [this, kind, url](transferengine::result && result) {
+					std::lock_guard<std::mutex> lock(stats_mutex);
+					auto & portal = stats[kind][url];
+					if (result.code == CURLE_OK) {
+						portal.latency = result.seconds_starttransfer;
+					} else {
+						++ portal.failures;
+					}
+					portal.measured = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+				});
+			}
+			savestats();
+			lock.lock();
+			probe_wake.wait_for(lock, std::chrono::duration<double>(std::min(seconds_stale / 4, 60.0)));
+		}
+	}
+
+	void loadstats()
+	{
+		auto json = file2json(statsfilename);
+		std::lock_guard<std::mutex> lock(stats_mutex);
+		for (auto kind : {skynet_multiportal::download, skynet_multiportal::upload}) {
+			std::string name = kind == skynet_multiportal::download ? "download" : "upload";
+			if (!json.contains(name)) { continue; }
+			for (auto & portal : json[name].items()) {
+				auto & entry = portal.value();
+				auto & loaded = stats[kind][portal.key()];
+				loaded.latency = entry.value("latency", 0.0);
+				loaded.throughput = entry.value("throughput", 0.0);
+				loaded.successes = entry.value("successes", 0);
+				loaded.failures = entry.value("failures", 0);
+				loaded.measured = entry.value("measured", 0.0);
+			}
+		}
+	}
+
+	void savestats()
+	{
+		nlohmann::json json;
+		{
+			std::lock_guard<std::mutex> lock(stats_mutex);
+			for (auto kind : {skynet_multiportal::download, skynet_multiportal::upload}) {
+				std::string name = kind == skynet_multiportal::download ? "download" : "upload";
+				for (auto & portal : stats[kind]) {
+					json[name][portal.first] = {
+						{"latency", portal.second.latency},
+						{"throughput", portal.second.throughput},
+						{"successes", portal.second.successes},
+						{"failures", portal.second.failures},
+						{"measured", portal.second.measured}
+					};
+				}
+			}
+		}
+		if (!json.is_null()) {
+			try {
+				json2file(json, statsfilename);
+			} catch (std::runtime_error const & e) {
+				std::cerr << statsfilename << ": " << e.what() << std::endl;
+			}
+		}
+	}
+
 	double bandwidth[2];
 	sia::skynet_multiportal multiportal;
 	
 	std::vector<worker> workers[2];
 	std::vector<size_t> free[2];
+
+	std::string statsfilename;
+	double seconds_stale;
+	std::mutex stats_mutex;
+	std::map<std::string, portalstats> stats[2];
+	size_t next_preferred[2] = {0, 0};
+	size_t started[2] = {0, 0};
+	bool probing = false;
+	std::condition_variable probe_wake;
+	std::thread prober;
+
+	transferengine engine;
 };
 
 }
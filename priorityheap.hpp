@@ -0,0 +1,146 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A max-heap of items by priority, for picking the neediest of many.
+// Each item carries a hook recording where it sits in the heap, so
+// reprioritizing or removing an item is O(log n) rather than a search.
+// Equal priorities come out in the order they were pushed.
+template <typename T>
+class priorityheap
+{
+public:
+	struct hook
+	{
+		hook(T * item)
+		: item(item)
+		{ }
+
+		T * const item;
+		uint64_t priority = 0;
+	private:
+		friend class priorityheap;
+		static constexpr size_t absent = ~(size_t)0;
+		size_t position = absent;
+		uint64_t sequence = 0;
+	};
+
+	bool contains(hook const & entry) const
+	{
+		return entry.position != hook::absent;
+	}
+
+	// inserts or reprioritizes, returns true if the item is now on top
+	bool push(hook & entry, uint64_t priority)
+	{
+		if (contains(entry)) {
+			if (priority == entry.priority) {
+				return entry.position == 0;
+			}
+			bool raised = priority > entry.priority;
+			entry.priority = priority;
+			entry.sequence = sequence ++;
+			if (raised) {
+				up(entry.position);
+			} else {
+				down(entry.position);
+			}
+		} else {
+			entry.priority = priority;
+			entry.sequence = sequence ++;
+			entry.position = entries.size();
+			entries.push_back(&entry);
+			up(entry.position);
+		}
+		return entry.position == 0;
+	}
+
+	void erase(hook & entry)
+	{
+		if (!contains(entry)) {
+			return;
+		}
+		size_t position = entry.position;
+		swap(position, entries.size() - 1);
+		entries.pop_back();
+		entry.position = hook::absent;
+		if (position < entries.size()) {
+			up(position);
+			down(position);
+		}
+	}
+
+	T * top() const
+	{
+		return entries.front()->item;
+	}
+
+	// removes and returns the neediest item
+	T * pop()
+	{
+		hook & entry = *entries.front();
+		erase(entry);
+		return entry.item;
+	}
+
+	size_t size() const
+	{
+		return entries.size();
+	}
+
+	bool empty() const
+	{
+		return entries.empty();
+	}
+
+private:
+	static bool before(hook const * a, hook const * b)
+	{
+		if (a->priority != b->priority) {
+			return a->priority > b->priority;
+		}
+		return a->sequence < b->sequence;
+	}
+
+	void swap(size_t a, size_t b)
+	{
+		std::swap(entries[a], entries[b]);
+		entries[a]->position = a;
+		entries[b]->position = b;
+	}
+
+	void up(size_t position)
+	{
+		while (position > 0) {
+			size_t parent = (position - 1) / 2;
+			if (!before(entries[position], entries[parent])) {
+				break;
+			}
+			swap(position, parent);
+			position = parent;
+		}
+	}
+
+	void down(size_t position)
+	{
+		while ("sifting") {
+			size_t best = position;
+			for (size_t child = position * 2 + 1; child <= position * 2 + 2 && child < entries.size(); ++ child) {
+				if (before(entries[child], entries[best])) {
+					best = child;
+				}
+			}
+			if (best == position) {
+				break;
+			}
+			swap(position, best);
+			position = best;
+		}
+	}
+
+	std::vector<hook *> entries;
+	uint64_t sequence = 0;
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// PoC2 nonce generation with Shabal-256, hashing several nonces at once.
+// The kernel is written once over a lane type; each instruction set
+// instantiates it in its own translation unit, built with that set's flags,
+// and the widest one the cpu supports is picked at runtime.
+namespace shabal {
+
+constexpr size_t noncesize = 4096 * 64;
+constexpr size_t seedsize = 16;
+constexpr size_t hashsize = 32;
+constexpr size_t hashcap = 4096;
+
+// one 32-bit word per nonce
+struct scalar
+{
+	using word = uint32_t;
+	static constexpr size_t count = 1;
+
+	static word set1(uint32_t value) { return value; }
+	// reads the word at offset in each lane, lanes being stride bytes apart from base
+	static word load(uint8_t const * base, size_t stride, size_t offset)
+	{
+		word result;
+		memcpy(&result, base + offset, sizeof(result));
+		return result;
+	}
+	static void store(word value, uint8_t * base, size_t stride, size_t offset)
+	{
+		memcpy(base + offset, &value, sizeof(value));
+	}
+	static word add(word a, word b) { return a + b; }
+	static word sub(word a, word b) { return a - b; }
+	static word xor_(word a, word b) { return a ^ b; }
+	static word andnot(word a, word b) { return a & ~b; }
+	static word not_(word a) { return ~a; }
+	template <int bits> static word shl(word a) { return a << bits; }
+	template <int bits> static word rotl(word a) { return (a << bits) | (a >> (32 - bits)); }
+};
+
+template <typename lanes>
+class hasher
+{
+public:
+	using word = typename lanes::word;
+
+	// hashes length bytes at offset in each lane, writing the digests at destination in each lane
+	void hash(uint8_t * base, size_t stride, size_t offset, size_t length, size_t destination)
+	{
+		start();
+		size_t position = 0;
+		for (; position + 64 <= length; position += 64) {
+			for (size_t index = 0; index < 16; ++ index) {
+				M[index] = lanes::load(base, stride, offset + position + index * 4);
+			}
+			block();
+		}
+		// the tail is padded with a one bit and zeros
+		uint8_t padded[lanes::count][64];
+		for (size_t lane = 0; lane < lanes::count; ++ lane) {
+			memcpy(padded[lane], base + lane * stride + offset + position, length - position);
+			padded[lane][length - position] = 0x80;
+			memset(padded[lane] + length - position + 1, 0, 64 - (length - position + 1));
+		}
+		for (size_t index = 0; index < 16; ++ index) {
+			M[index] = lanes::load(padded[0], 64, index * 4);
+		}
+		finish();
+		for (size_t index = 0; index < 8; ++ index) {
+			lanes::store(B[8 + index], base, stride, destination + index * 4);
+		}
+	}
+
+	// the state after hashing the two prefix blocks of 16 counting words, with the counter starting at -1
+	static hasher const & initial()
+	{
+		static hasher const iv = []() {
+			hasher state;
+			for (auto & word : state.A) { word = lanes::set1(0); }
+			for (auto & word : state.B) { word = lanes::set1(0); }
+			for (auto & word : state.C) { word = lanes::set1(0); }
+			state.W = ~(uint64_t)0;
+			for (uint32_t prefix = 256; prefix < 288; prefix += 16) {
+				for (uint32_t index = 0; index < 16; ++ index) {
+					state.M[index] = lanes::set1(prefix + index);
+				}
+				state.block();
+			}
+			return state;
+		}();
+		return iv;
+	}
+
+private:
+	void start()
+	{
+		auto & iv = initial();
+		memcpy(A, iv.A, sizeof(A));
+		memcpy(B, iv.B, sizeof(B));
+		memcpy(C, iv.C, sizeof(C));
+		W = iv.W;
+	}
+
+	void block()
+	{
+		for (size_t index = 0; index < 16; ++ index) {
+			B[index] = lanes::add(B[index], M[index]);
+		}
+		counter();
+		permute();
+		for (size_t index = 0; index < 16; ++ index) {
+			C[index] = lanes::sub(C[index], M[index]);
+		}
+		swap();
+		++ W;
+	}
+
+	// the last block, then three more permutations without input or counting
+	void finish()
+	{
+		for (size_t index = 0; index < 16; ++ index) {
+			B[index] = lanes::add(B[index], M[index]);
+		}
+		counter();
+		permute();
+		for (int round = 0; round < 3; ++ round) {
+			swap();
+			counter();
+			permute();
+		}
+	}
+
+	void counter()
+	{
+		A[0] = lanes::xor_(A[0], lanes::set1((uint32_t)W));
+		A[1] = lanes::xor_(A[1], lanes::set1((uint32_t)(W >> 32)));
+	}
+
+	void swap()
+	{
+		for (size_t index = 0; index < 16; ++ index) {
+			word held = B[index];
+			B[index] = C[index];
+			C[index] = held;
+		}
+	}
+
+	static word times3(word a) { return lanes::add(a, lanes::template shl<1>(a)); }
+	static word times5(word a) { return lanes::add(a, lanes::template shl<2>(a)); }
+
+	void permute()
+	{
+		for (size_t index = 0; index < 16; ++ index) {
+			B[index] = lanes::template rotl<17>(B[index]);
+		}
+		// unrolled, so the indices are constants and the state can stay in registers
+		#pragma GCC unroll 3
+		for (size_t round = 0; round < 3; ++ round) {
+			#pragma GCC unroll 16
+			for (size_t index = 0; index < 16; ++ index) {
+				word & a = A[(index + 16 * round) % 12];
+				word previous = A[(index + 16 * round + 11) % 12];
+				a = lanes::xor_(times3(lanes::xor_(lanes::xor_(a, times5(lanes::template rotl<15>(previous))), C[(24 - index) % 16])),
+					lanes::xor_(lanes::xor_(B[(index + 13) % 16], lanes::andnot(B[(index + 9) % 16], B[(index + 6) % 16])), M[index]));
+				B[index] = lanes::not_(lanes::xor_(lanes::template rotl<1>(B[index]), a));
+			}
+		}
+		#pragma GCC unroll 36
+		for (size_t index = 0; index < 36; ++ index) {
+			word & a = A[(47 - index) % 12];
+			a = lanes::add(a, C[(54 - index) % 16]);
+		}
+	}
+
+	word A[12], B[16], C[16], M[16];
+	uint64_t W;
+};
+
+// creates lanes::count consecutive PoC2 nonces from nonce on, each noncesize bytes, into buffer
+template <typename lanes>
+void plot(uint64_t account, uint64_t nonce, uint8_t * buffer)
+{
+	// each lane's bytes are followed by the seed, which the final hash then overwrites
+	constexpr size_t stride = noncesize + hashsize;
+	static thread_local std::vector<uint8_t> scratch;
+	scratch.resize(lanes::count * stride);
+	uint8_t * base = scratch.data();
+
+	// the seed follows the nonce's bytes: account and nonce number, big-endian
+	for (size_t lane = 0; lane < lanes::count; ++ lane) {
+		uint8_t * seed = base + lane * stride + noncesize;
+		for (size_t index = 0; index < 8; ++ index) {
+			seed[index] = account >> (56 - index * 8);
+			seed[8 + index] = (nonce + lane) >> (56 - index * 8);
+		}
+	}
+	// each hash covers up to hashcap bytes after it, working backwards from the seed
+	hasher<lanes> state;
+	for (size_t offset = noncesize; offset > 0; offset -= hashsize) {
+		size_t length = std::min(noncesize + seedsize - offset, hashcap);
+		state.hash(base, stride, offset, length, offset - hashsize);
+	}
+	// then the whole of it is mixed with a final hash over everything
+	state.hash(base, stride, 0, noncesize + seedsize, noncesize);
+	for (size_t lane = 0; lane < lanes::count; ++ lane) {
+		uint8_t const * source = base + lane * stride;
+		uint8_t const * mix = source + noncesize;
+		uint8_t * out = buffer + lane * noncesize;
+		// PoC2 swaps the second hash of each scoop with that of its mirror scoop
+		for (size_t scoop = 0; scoop < 4096; ++ scoop) {
+			uint8_t const * first = source + scoop * 64;
+			uint8_t const * second = source + (4095 - scoop) * 64 + hashsize;
+			for (size_t index = 0; index < hashsize; ++ index) {
+				out[scoop * 64 + index] = first[index] ^ mix[index];
+				out[scoop * 64 + hashsize + index] = second[index] ^ mix[index];
+			}
+		}
+	}
+}
+
+// each kernel creates lanes nonces at once
+struct kernel
+{
+	char const * name;
+	size_t lanes;
+	void (*plot)(uint64_t account, uint64_t nonce, uint8_t * buffer);
+};
+
+void plot_sse2(uint64_t account, uint64_t nonce, uint8_t * buffer);
+void plot_avx2(uint64_t account, uint64_t nonce, uint8_t * buffer);
+void plot_avx512(uint64_t account, uint64_t nonce, uint8_t * buffer);
+
+// the kernels this cpu can run, narrowest first
+inline std::vector<kernel> const & kernels()
+{
+	static std::vector<kernel> const supported = []() {
+		std::vector<kernel> result{{"scalar", 1, &plot<scalar>}};
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse2")) {
+			result.push_back({"sse2", 4, &plot_sse2});
+		}
+		if (__builtin_cpu_supports("avx2")) {
+			result.push_back({"avx2", 8, &plot_avx2});
+		}
+		if (__builtin_cpu_supports("avx512f")) {
+			result.push_back({"avx512", 16, &plot_avx512});
+		}
+		return result;
+	}();
+	return supported;
+}
+
+// how many nonces the widest kernel creates at once
+inline size_t lanes()
+{
+	return kernels().back().lanes;
+}
+
+// creates count consecutive PoC2 nonces from nonce on into buffer, the same bytes create_plot gives
+inline void plot(uint64_t account, uint64_t nonce, size_t count, uint8_t * buffer)
+{
+	auto & widest = kernels().back();
+	for (; count >= widest.lanes; count -= widest.lanes) {
+		widest.plot(account, nonce, buffer);
+		nonce += widest.lanes;
+		buffer += widest.lanes * noncesize;
+	}
+	for (; count > 0; -- count) {
+		plot<scalar>(account, nonce, buffer);
+		++ nonce;
+		buffer += noncesize;
+	}
+}
+
+}
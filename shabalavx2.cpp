@@ -0,0 +1,42 @@
+// built with -mavx2
+#include "shabal.hpp"
+
+#include <immintrin.h>
+
+namespace shabal {
+
+struct avx2
+{
+	using word = __m256i;
+	static constexpr size_t count = 8;
+
+	static word set1(uint32_t value) { return _mm256_set1_epi32(value); }
+	// lanes are gathered at stride apart
+	static word load(uint8_t const * base, size_t stride, size_t offset)
+	{
+		__m256i lanes = _mm256_mullo_epi32(_mm256_set1_epi32(stride), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		return _mm256_i32gather_epi32((int const *)(base + offset), lanes, 1);
+	}
+	static void store(word value, uint8_t * base, size_t stride, size_t offset)
+	{
+		uint32_t words[count];
+		_mm256_storeu_si256((word *)words, value);
+		for (size_t lane = 0; lane < count; ++ lane) {
+			memcpy(base + lane * stride + offset, &words[lane], sizeof(uint32_t));
+		}
+	}
+	static word add(word a, word b) { return _mm256_add_epi32(a, b); }
+	static word sub(word a, word b) { return _mm256_sub_epi32(a, b); }
+	static word xor_(word a, word b) { return _mm256_xor_si256(a, b); }
+	static word andnot(word a, word b) { return _mm256_andnot_si256(b, a); }
+	static word not_(word a) { return _mm256_xor_si256(a, _mm256_set1_epi32(-1)); }
+	template <int bits> static word shl(word a) { return _mm256_slli_epi32(a, bits); }
+	template <int bits> static word rotl(word a) { return _mm256_or_si256(_mm256_slli_epi32(a, bits), _mm256_srli_epi32(a, 32 - bits)); }
+};
+
+void plot_avx2(uint64_t account, uint64_t nonce, uint8_t * buffer)
+{
+	plot<avx2>(account, nonce, buffer);
+}
+
+}
@@ -0,0 +1,40 @@
+// built with -mavx512f
+#include "shabal.hpp"
+
+#include <immintrin.h>
+
+namespace shabal {
+
+struct avx512
+{
+	using word = __m512i;
+	static constexpr size_t count = 16;
+
+	static word set1(uint32_t value) { return _mm512_set1_epi32(value); }
+	// lanes are gathered at stride apart
+	static word load(uint8_t const * base, size_t stride, size_t offset)
+	{
+		__m512i lanes = _mm512_mullo_epi32(_mm512_set1_epi32(stride), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+		return _mm512_i32gather_epi32(lanes, base + offset, 1);
+	}
+	// and scattered back
+	static void store(word value, uint8_t * base, size_t stride, size_t offset)
+	{
+		__m512i lanes = _mm512_mullo_epi32(_mm512_set1_epi32(stride), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+		_mm512_i32scatter_epi32(base + offset, lanes, value, 1);
+	}
+	static word add(word a, word b) { return _mm512_add_epi32(a, b); }
+	static word sub(word a, word b) { return _mm512_sub_epi32(a, b); }
+	static word xor_(word a, word b) { return _mm512_xor_si512(a, b); }
+	static word andnot(word a, word b) { return _mm512_andnot_si512(b, a); }
+	static word not_(word a) { return _mm512_ternarylogic_epi32(a, a, a, 0x55); }
+	template <int bits> static word shl(word a) { return _mm512_slli_epi32(a, bits); }
+	template <int bits> static word rotl(word a) { return _mm512_or_si512(_mm512_slli_epi32(a, bits), _mm512_srli_epi32(a, 32 - bits)); }
+};
+
+void plot_avx512(uint64_t account, uint64_t nonce, uint8_t * buffer)
+{
+	plot<avx512>(account, nonce, buffer);
+}
+
+}
@@ -0,0 +1,44 @@
+// built with -msse2
+#include "shabal.hpp"
+
+#include <immintrin.h>
+
+namespace shabal {
+
+struct sse2
+{
+	using word = __m128i;
+	static constexpr size_t count = 4;
+
+	static word set1(uint32_t value) { return _mm_set1_epi32(value); }
+	static word load(uint8_t const * base, size_t stride, size_t offset)
+	{
+		uint32_t words[count];
+		for (size_t lane = 0; lane < count; ++ lane) {
+			memcpy(&words[lane], base + lane * stride + offset, sizeof(uint32_t));
+		}
+		return _mm_loadu_si128((word const *)words);
+	}
+	static void store(word value, uint8_t * base, size_t stride, size_t offset)
+	{
+		uint32_t words[count];
+		_mm_storeu_si128((word *)words, value);
+		for (size_t lane = 0; lane < count; ++ lane) {
+			memcpy(base + lane * stride + offset, &words[lane], sizeof(uint32_t));
+		}
+	}
+	static word add(word a, word b) { return _mm_add_epi32(a, b); }
+	static word sub(word a, word b) { return _mm_sub_epi32(a, b); }
+	static word xor_(word a, word b) { return _mm_xor_si128(a, b); }
+	static word andnot(word a, word b) { return _mm_andnot_si128(b, a); }
+	static word not_(word a) { return _mm_xor_si128(a, _mm_set1_epi32(-1)); }
+	template <int bits> static word shl(word a) { return _mm_slli_epi32(a, bits); }
+	template <int bits> static word rotl(word a) { return _mm_or_si128(_mm_slli_epi32(a, bits), _mm_srli_epi32(a, 32 - bits)); }
+};
+
+void plot_sse2(uint64_t account, uint64_t nonce, uint8_t * buffer)
+{
+	plot<sse2>(account, nonce, buffer);
+}
+
+}
@@ -0,0 +1,48 @@
+// checks each nonce kernel the cpu runs against libShabal's create_plot, byte for byte
+
+#include <cstdint>
+
+extern "C" {
+
+void create_plot(uint64_t account_id,
+                 uint64_t nonce,
+                 uint8_t poc_version,
+                 uint8_t *plot_buffer,
+                 uintptr_t plot_buffer_offset);
+
+}
+
+#include <iostream>
+
+#include "shabal.hpp"
+
+int main(int argc, char **argv)
+{
+	uint64_t account = 10282355196851764065ull;
+	uint64_t start = 1234567;
+	// one more than the widest kernel, so the scalar remainder of shabal::plot is covered too
+	size_t count = shabal::lanes() + 1;
+	std::vector<uint8_t> expected(count * shabal::noncesize);
+	for (size_t index = 0; index < count; ++ index) {
+		create_plot(account, start + index, 2, expected.data(), index * shabal::noncesize);
+	}
+
+	int result = 0;
+	for (auto & kernel : shabal::kernels()) {
+		std::vector<uint8_t> nonces(kernel.lanes * shabal::noncesize);
+		kernel.plot(account, start, nonces.data());
+		bool match = std::equal(nonces.begin(), nonces.end(), expected.begin());
+		std::cout << kernel.name << ": " << (match ? "ok" : "MISMATCH") << std::endl;
+		if (!match) {
+			result = 1;
+		}
+	}
+	std::vector<uint8_t> nonces(count * shabal::noncesize);
+	shabal::plot(account, start, count, nonces.data());
+	bool match = nonces == expected;
+	std::cout << "plot: " << (match ? "ok" : "MISMATCH") << std::endl;
+	if (!match) {
+		result = 1;
+	}
+	return result;
+}
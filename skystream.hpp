@@ -1,6 +1,8 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <thread>
 #include <unordered_map>
 
@@ -12,6 +14,8 @@
 #include "portalpool.hpp"
 
 #include "crypto.hpp"
+#include "slice.hpp"
+#include "taskpool.hpp"
 
 using seconds_t = double;
 
@@ -31,11 +35,14 @@ public:
 		tail.identifiers = cryptography.digests({&data});
 		tail.identifiers[way] = link;
 	}
-	skystream(sia::portalpool & portalpool, nlohmann::json identifiers = {})
+	// metadata, if given, is the tail's already, such as from a local snapshot, and is not downloaded
+	skystream(sia::portalpool & portalpool, nlohmann::json identifiers = {}, nlohmann::json metadata = {})
 	: portalpool(portalpool)
 	{
 		tail.identifiers = identifiers;
-		if (!identifiers.empty()) {
+		if (!metadata.is_null()) {
+			tail.metadata = std::move(metadata);
+		} else if (!identifiers.empty()) {
 			tail.metadata = get_json(identifiers);
 		} else {
 			auto now = time();
@@ -59,32 +66,69 @@ public:
 
 	std::vector<uint8_t> read(std::string span, double & offset, std::string flow = "real", sia::portalpool::worker const * worker = 0)
 	{
-		auto metadata = this->get_node(tail, span, offset, {}, worker).metadata;
-		std::lock_guard<std::mutex> lock(methodmtx);
-		auto metadata_content = metadata["content"];
-		double content_start = metadata_content["spans"][span]["start"];
-		if (span != "bytes" && offset != content_start) {
-			throw std::runtime_error(span + " " + std::to_string(offset) + " is within block span");
-		}
-		auto data = get(metadata_content["identifiers"], worker);
-	
-		auto begin = data.begin() + offset - content_start;
-		// the goal here was, if the span is bytes, to use it as the offset in
-		// otherwise, to just return the whole chunk
-		auto end = begin;
-		if (span == "bytes") {
-			end += (uint64_t)metadata_content["bounds"]["bytes"]["end"] - content_start;
-		} else {
-			end = data.end();
-		}
-		offset = metadata_content["bounds"][span]["end"];
-		return {begin, end};
+		auto block = locate(span, offset, worker);
+		return extract(block, get(block.identifiers, worker)).release();
 	}
 
+	// locates the block in the calling thread, advancing offset past it, then downloads it asynchronously.
+	// done is given a slice of the downloaded buffer, or no data if cancelled.
+	void read(std::string span, double & offset, std::function<void(sia::slice)> done, std::string flow = "real", sia::portalpool::worker const * worker = 0, sia::canceltoken cancel = {})
+	{
+		auto block = locate(span, offset, worker);
+		get(block.identifiers, [block, done](sia::slice data) {
+			done(data.size() ? extract(block, std::move(data)) : std::move(data));
+		}, worker, cancel);
+	}
+
+	// reads up to length bytes at offset, to the end of the block holding it, downloading only that range of the block
+	// and advancing offset past the block.  the block's digests cover all of it, so the bytes are not verified; this is
+	// for callers that check them against what they expect.  done is given the bytes, or no data if the download fails.
+	void read_range(double & offset, size_t length, std::function<void(sia::slice)> done, sia::portalpool::worker const * worker = 0)
+	{
+		auto block = locate("bytes", offset, worker);
+		size_t begin = block.offset - block.content_start;
+		length = std::min(length, (size_t)(block.end - block.offset));
+		portalpool.download(block.identifiers["skylink"], {{begin, begin + length}}, 1024*1024*64, false, worker, [done, length](sia::skynet::response && response) {
+			if (response.data.size() != length) {
+				response.data.clear();
+			}
+			done(sia::slice(std::move(response.data)));
+		});
+	}
+
+	// the data is adopted, and uploaded without being copied
+	double write(std::vector<uint8_t> && data, std::string span, double offset, sia::portalpool::worker const * worker = 0)
+	{
+		return write(std::vector<sia::slice>{sia::slice(std::move(data))}, span, offset, worker);
+	}
+
+	// a block prepared for writing, which may be uploaded alongside blocks of other streams.
+	// further writes to the stream wait until it is written.
+	struct pendingwrite
+	{
+		skystream * stream;
+		std::vector<sia::slice> data;
+		nlohmann::json metadata;
+		std::unique_lock<std::mutex> writelock;
+	};
+
+	// writes the slices as one block, returning the seconds the upload itself took
+	double write(std::vector<sia::slice> const & data, std::string span, double offset, sia::portalpool::worker const * worker = 0)
+	{
+		std::vector<pendingwrite> writes;
+		writes.emplace_back(prepare_write(data, span, offset, worker));
+		return write(writes, worker);
+	}
+
+	// builds the metadata for writing the slices as one block
 	std::mutex writemtx;
-	void write(std::vector<uint8_t> & data, std::string span, double offset, sia::portalpool::worker const * worker = 0)
+	pendingwrite prepare_write(std::vector<sia::slice> const & data, std::string span, double offset, sia::portalpool::worker const * worker = 0)
 	{
-		std::lock_guard<std::mutex> writelock(writemtx);
+		std::unique_lock<std::mutex> writelock(writemtx);
+		size_t size = 0;
+		for (auto & chunk : data) {
+			size += chunk.size();
+		}
 
 		std::unique_lock<std::mutex> lock(methodmtx);
 		seconds_t end_time = time();
@@ -121,7 +165,7 @@ public:
 			}
 			//full_size = data.size() + offset - start_head; // full_size is the number of bytes including the beginning bits of head_node
 		}
-		unsigned long long end_bytes = start_bytes + data.size(); /*full_size*/
+		unsigned long long end_bytes = start_bytes + size; /*full_size*/
 		nlohmann::json spans = { // these are the spans of the new write
 			{"time", {{"start", start_time},{"end", end_time}}},
 			{"bytes", {{"start", start_bytes},{"end", end_bytes}}},
@@ -260,7 +304,7 @@ public:
 		//  2. if !tail_bounds.is_null(), then add a lookup reference for tail
 		//  3. reference node hierarchies until real tail to complete reference to rest of doc
 
-		auto content_identifiers = cryptography.digests({&data});
+		auto content_identifiers = cryptography.digests(data);
 		nlohmann::json metadata_json = {
 			{"sia-skynet-stream", "1.0.10"},
 			{"content", {
@@ -275,39 +319,61 @@ public:
 			*/
 			{"lookup", lookup_nodes}
 		};
-		std::string metadata_string = metadata_json.dump();
-		//std::cerr << metadata_string << std::endl;
-
-		sia::skynet::upload_data metadata_upload("metadata.json", std::vector<uint8_t>{metadata_string.begin(), metadata_string.end()}, "application/json");
-		sia::skynet::upload_data content("content", data, "application/octet-stream");
 
 		// CHANGE 3C: let's try to reuse all surrounding data using the new 'bounds' attribute
 		// 3C: TODO: we want to insert into content from head_node if we are doing a midway-write (full_size above).  we could also split the write into two.
 
-		auto metadata_identifiers = cryptography.digests({&metadata_upload.data});
+		return {this, data, metadata_json, std::move(writelock)};
+	}
 
-		lock.unlock();
+	// uploads prepared blocks, of one stream or many, as a single upload, and moves each stream's tail onto its block.
+	// a lone block is named metadata.json and content; in a batch each stream's files are numbered and its metadata names its content.
+	// if the upload fails, the tails stay where they were and std::runtime_error is thrown.
+	// returns the seconds the transfer engine took on the upload, not counting the wait for a worker.
+	static double write(std::vector<pendingwrite> & writes, sia::portalpool::worker const * worker = 0)
+	{
+		if (writes.empty()) {
+			return 0;
+		}
+		std::vector<sia::portalpool::file> files;
+		std::vector<nlohmann::json> metadata_identifiers;
+		for (size_t index = 0; index < writes.size(); ++ index) {
+			auto & write = writes[index];
+			std::string suffix;
+			if (writes.size() > 1) {
+				suffix = "-" + std::to_string(index);
+				write.metadata["content"]["filename"] = "content" + suffix;
+			}
+			std::string metadata_string = write.metadata.dump();
+			//std::cerr << metadata_string << std::endl;
+			files.push_back({"metadata" + suffix + ".json", {sia::slice(std::vector<uint8_t>{metadata_string.begin(), metadata_string.end()})}, "application/json"});
+			metadata_identifiers.emplace_back(write.stream->cryptography.digests(files.back().data));
+			files.push_back({"content" + suffix, write.data, "application/octet-stream"});
+		}
+		auto & portalpool = writes.front().stream->portalpool;
 
-		std::mutex skylink_mutex;
-		std::string skylink;
-		auto ensure_upload = [&]() {
-			std::string link = portalpool.upload(metadata_identifiers["sha3_512"], {metadata_upload, content}, false, worker);
-			{
-				std::lock_guard<std::mutex> lock(skylink_mutex);
-				skylink = link;
-			} 
-		};
-		auto upload1 = std::thread(ensure_upload);
-		auto upload2 = std::thread(ensure_upload);
-		upload1.join();
-		upload2.join();
-		lock.lock();
-		metadata_identifiers["skylink"] = skylink + "/" + metadata_upload.filename;
-
-		// if we want to support threading we'll likely need a lock around this whole function (not just the change to tail)
-		// 	later: i've done that, but haven't integrated with old stuff to simplify
-		tail.identifiers = metadata_identifiers;
-		tail.metadata = metadata_json;
+		double seconds;
+		std::string skylink = portalpool.upload(metadata_identifiers[0]["sha3_512"], files, false, worker, &seconds);
+		if (skylink.empty()) {
+			throw std::runtime_error("upload of " + std::to_string(writes.size()) + " blocks failed");
+		}
+		for (size_t index = 0; index < writes.size(); ++ index) {
+			auto & write = writes[index];
+			auto & stream = *write.stream;
+			metadata_identifiers[index]["skylink"] = skylink + "/" + files[index * 2].filename;
+			// as get_json does for metadata it downloads, so the tail's own block can be read back
+			write.metadata["content"]["identifiers"]["skylink"] = skylink + "/" + files[index * 2 + 1].filename;
+
+			// if we want to support threading we'll likely need a lock around this whole function (not just the change to tail)
+			// 	later: i've done that, but haven't integrated with old stuff to simplify
+			std::lock_guard<std::mutex> lock(stream.methodmtx);
+			stream.tail.identifiers = metadata_identifiers[index];
+			stream.tail.metadata = std::move(write.metadata);
+		}
+		for (auto & write : writes) {
+			write.writelock.unlock();
+		}
+		return seconds;
 	}
 
 	std::map<std::string,std::pair<double,double>> block_spans(std::string span, double offset, sia::portalpool::worker const * worker = 0)
@@ -374,24 +440,105 @@ public:
 		return tail.identifiers;
 	}
 
+	// the tail's identifiers and metadata together, as a local snapshot keeps them
+	nlohmann::json tail_json()
+	{
+		std::lock_guard<std::mutex> lock(methodmtx);
+		return {{"identifiers", tail.identifiers}, {"metadata", tail.metadata}};
+	}
+
+	// downloads the tail's metadata again and compares it with what is held, such as metadata from a snapshot.
+	// a tail that moved on meanwhile was written here, so it matches.
+	bool tail_matches()
+	{
+		auto identifiers = this->identifiers();
+		if (identifiers.empty()) {
+			return true;
+		}
+		auto metadata = get_json(identifiers);
+		std::lock_guard<std::mutex> lock(methodmtx);
+		if (tail.identifiers != identifiers) {
+			return true;
+		}
+		// get_node notes the bounds of content it reads on the node; they are not part of what was uploaded
+		auto held = tail.metadata;
+		held["content"].erase("bounds");
+		metadata["content"].erase("bounds");
+		return held == metadata;
+	}
+
+	// lets go of the metadata of earlier blocks found while reading, to be downloaded again when next needed
+	void drop_cache()
+	{
+		std::lock_guard<std::mutex> lock(methodmtx);
+		cache.clear();
+	}
+
+	// moves the tail on to a later block of this stream, such as one written before a restart
+	void set_tail(nlohmann::json identifiers)
+	{
+		auto metadata = get_json(identifiers);
+		std::lock_guard<std::mutex> writelock(writemtx);
+		std::lock_guard<std::mutex> lock(methodmtx);
+		tail.identifiers = identifiers;
+		tail.metadata = std::move(metadata);
+	}
+
 	std::vector<uint8_t> get(nlohmann::json identifiers, sia::portalpool::worker const * worker = 0)
 	{
 		auto skylink = identifiers["skylink"];
 		std::vector<uint8_t> result = portalpool.download(skylink, {}, 1024*1024*64, false, worker).data;
-		auto digests = cryptography.digests({&result});
-		for (auto & digest : digests.items()) {
-			if (identifiers.contains(digest.key())) {
-				if (digest.value() != identifiers[digest.key()]) {
-					throw std::runtime_error(digest.key() + " digest mismatch.  identifiers=" + identifiers.dump() + " digests=" + digests.dump());
-				}
-			}
+		auto mismatch = verify(identifiers, result);
+		if (mismatch.size()) {
+			throw std::runtime_error(mismatch);
 		}
 		return result;
 	}
 
+	// asynchronous get, which downloads again, a few times at most, if the data does not match its digests.
+	// the downloaded buffer is adopted, not copied.  if cancelled, or the download fails, done is called with no data.
+	void get(nlohmann::json identifiers, std::function<void(sia::slice)> done, sia::portalpool::worker const * worker = 0, sia::canceltoken cancel = {})
+	{
+		get_attempt(identifiers, done, worker, cancel, 0);
+	}
+
 protected:
+	// how many times an asynchronous get downloads data that does not match before giving up
+	static constexpr size_t get_attempts = 4;
+
+	void get_attempt(nlohmann::json identifiers, std::function<void(sia::slice)> done, sia::portalpool::worker const * worker, sia::canceltoken cancel, size_t attempt)
+	{
+		portalpool.download(identifiers["skylink"], {}, 1024*1024*64, false, worker, [this, identifiers, done, worker, cancel, attempt](sia::skynet::response && response) {
+			// the portal pool gives no data once a download is aborted, or has failed on every portal it tried
+			if ((cancel && cancel->cancelled()) || response.data.empty()) {
+				done({});
+				return;
+			}
+			// hashing is too slow for the transfer engine thread, so it is run as a task if possible
+			auto check = [this, identifiers, done, worker, cancel, attempt, data = std::move(response.data)]() mutable {
+				auto mismatch = verify(identifiers, data);
+				if (mismatch.size()) {
+					std::cerr << mismatch << std::endl;
+					if (attempt + 1 >= get_attempts) {
+						done({});
+					} else {
+						get_attempt(identifiers, done, worker, cancel, attempt + 1);
+					}
+					return;
+				}
+				done(sia::slice(std::move(data)));
+			};
+			if (tasks) {
+				tasks->submit(std::move(check));
+			} else {
+				check();
+			}
+		}, cancel);
+	}
+
 	std::mutex methodmtx;
 	sia::portalpool & portalpool;
+	taskpool * tasks = nullptr; // runs verification of asynchronous gets, if set
 
 private:
 	struct node
@@ -400,6 +547,55 @@ private:
 		nlohmann::json metadata;
 	};
 
+	struct block
+	{
+		nlohmann::json identifiers;
+		double content_start;
+		double offset;
+		double end; // bytes end, or -1 to return the whole block
+	};
+
+	block locate(std::string span, double & offset, sia::portalpool::worker const * worker)
+	{
+		std::lock_guard<std::mutex> lock(methodmtx);
+		auto metadata = this->get_node(tail, span, offset, {}, worker).metadata;
+		auto metadata_content = metadata["content"];
+		double content_start = metadata_content["spans"][span]["start"];
+		if (span != "bytes" && offset != content_start) {
+			throw std::runtime_error(span + " " + std::to_string(offset) + " is within block span");
+		}
+		block result{metadata_content["identifiers"], content_start, offset, -1};
+		// the goal here was, if the span is bytes, to use it as the offset in
+		// otherwise, to just return the whole chunk
+		if (span == "bytes") {
+			result.end = metadata_content["bounds"]["bytes"]["end"];
+		}
+		offset = metadata_content["bounds"][span]["end"];
+		return result;
+	}
+
+	static sia::slice extract(block const & block, sia::slice data)
+	{
+		size_t begin = block.offset - block.content_start;
+		if (block.end < 0) {
+			return data.sub(begin);
+		}
+		return data.sub(begin, (uint64_t)block.end - block.offset);
+	}
+
+	std::string verify(nlohmann::json const & identifiers, std::vector<uint8_t> const & data)
+	{
+		auto digests = cryptography.digests({&data});
+		for (auto & digest : digests.items()) {
+			if (identifiers.contains(digest.key())) {
+				if (digest.value() != identifiers[digest.key()]) {
+					return digest.key() + " digest mismatch.  identifiers=" + identifiers.dump() + " digests=" + digests.dump();
+				}
+			}
+		}
+		return {};
+	}
+
 	node & get_node(node & start, std::string span, double offset, nlohmann::json bounds = {}, sia::portalpool::worker const * worker = 0)
 	{
 		auto content_spans = start.metadata["content"]["spans"];
@@ -441,8 +637,9 @@ private:
 		if (data) { *data = data_result; }
 		auto result = nlohmann::json::parse(data_result);
 		// TODO improve (refactor?), hardcodes storage system and is slow due to 2 requests for each chunk
+		// the content sits beside the metadata, under the name the metadata gives if it was uploaded in a batch
 		std::string skylink = identifiers["skylink"];
-		skylink.resize(52); skylink += "/content";
+		skylink.resize(52); skylink += "/" + result["content"].value("filename", std::string("content"));
 		result["content"]["identifiers"]["skylink"] = skylink;
 		return result;
 	}
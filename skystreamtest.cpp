@@ -104,9 +104,7 @@ int main(int argc, char **argv)
 		auto range = stream.span(span);
 		double offset = range.second;
 		std::cerr << "Uploading to " << options["up"] << " from stdout starting from " << span << " " << offset << std::endl;
-		std::vector<uint8_t> data;
-		data.reserve(1024*1024*16);
-		data.resize(data.capacity());
+		std::vector<uint8_t> data(1024*1024*16);
 		ssize_t size;
 		while ((size = read(0, data.data(), data.size()))) {
 			if (size < 0) {
@@ -114,11 +112,12 @@ int main(int argc, char **argv)
 				return size;
 			}
 			data.resize(size);
-			stream.write(data, "bytes", offset);
-			std::cerr << "Uploaded " << data.size() << " bytes" << std::endl;
+			stream.write(std::move(data), "bytes", offset);
+			std::cerr << "Uploaded " << size << " bytes" << std::endl;
 			json2file(stream.identifiers(), options["up"]);
-			offset += data.size();
-			data.resize(data.capacity());
+			offset += size;
+			// write adopted the last buffer
+			data = std::vector<uint8_t>(1024*1024*16);
 		}
 	}
 }
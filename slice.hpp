@@ -0,0 +1,263 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace sia {
+
+// A window onto reference-counted bytes.  Slices share their buffer,
+// so passing one along or taking a part of it copies nothing.
+class slice
+{
+public:
+	slice()
+	: bytes(nullptr), length(0)
+	{ }
+
+	// adopts the vector
+	slice(std::vector<uint8_t> && data)
+	: buffer(std::make_shared<std::vector<uint8_t>>(std::move(data))),
+	  bytes(buffer->data()),
+	  length(buffer->size())
+	{ }
+
+	slice(std::shared_ptr<std::vector<uint8_t>> buffer, size_t offset, size_t length)
+	: buffer(std::move(buffer)),
+	  bytes(this->buffer->data() + offset),
+	  length(length)
+	{ }
+
+	// memory kept alive by owner rather than a vector, such as a mapped file
+	slice(std::shared_ptr<void const> owner, uint8_t const * bytes, size_t length)
+	: owner(std::move(owner)),
+	  bytes(bytes),
+	  length(length)
+	{ }
+
+	uint8_t const * data() const { return bytes; }
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+	uint8_t const * begin() const { return bytes; }
+	uint8_t const * end() const { return bytes + length; }
+	uint8_t operator[](size_t index) const { return bytes[index]; }
+
+	slice sub(size_t offset, size_t length = ~(size_t)0) const
+	{
+		slice part(*this);
+		if (offset > this->length) {
+			offset = this->length;
+		}
+		if (length > this->length - offset) {
+			length = this->length - offset;
+		}
+		part.bytes += offset;
+		part.length = length;
+		return part;
+	}
+
+	// whether the bytes are held by something other than a vector
+	bool foreign() const
+	{
+		return (bool)owner;
+	}
+
+	// the bytes as a vector, moved out of the buffer if nothing else shares it
+	std::vector<uint8_t> release() &&
+	{
+		std::vector<uint8_t> result;
+		if (buffer && buffer.use_count() == 1 && bytes == buffer->data() && length == buffer->size()) {
+			result = std::move(*buffer);
+		} else {
+			result.assign(begin(), end());
+		}
+		*this = {};
+		return result;
+	}
+
+	bool operator==(std::vector<uint8_t> const & other) const
+	{
+		return length == other.size() && (length == 0 || 0 == memcmp(bytes, other.data(), length));
+	}
+	bool operator!=(std::vector<uint8_t> const & other) const
+	{
+		return !(*this == other);
+	}
+
+private:
+	friend class slicequeue;
+	std::shared_ptr<std::vector<uint8_t>> buffer;
+	std::shared_ptr<void const> owner;
+	uint8_t const * bytes;
+	size_t length;
+};
+
+// Bytes queued as a chain of slices.  Large appends are adopted as they
+// are, small ones are gathered into chunks of chunksize, and bytes are
+// taken from the front without moving what remains.  Foreign memory is
+// always adopted, with an append that carries on from the last slice of
+// the same memory extending it.
+class slicequeue
+{
+public:
+	slicequeue(size_t chunksize = 1024*1024)
+	: chunksize(chunksize), length(0)
+	{ }
+
+	void push(slice part)
+	{
+		if (part.empty()) {
+			return;
+		}
+		length += part.size();
+		if (part.foreign()) {
+			open.reset();
+			if (parts.size() && parts.back().owner == part.owner && parts.back().end() == part.begin()) {
+				parts.back().length += part.size();
+			} else {
+				parts.emplace_back(std::move(part));
+			}
+			return;
+		}
+		if (part.size() >= chunksize / 2) {
+			open.reset();
+			parts.emplace_back(std::move(part));
+			return;
+		}
+		if (!open || open->size() + part.size() > open->capacity()) {
+			open = std::make_shared<std::vector<uint8_t>>();
+			open->reserve(chunksize);
+			parts.emplace_back(open, 0, 0);
+		}
+		// the chunk is reserved, so earlier slices of it stay valid as it fills
+		open->insert(open->end(), part.begin(), part.end());
+		parts.back().length += part.size();
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+	bool empty() const
+	{
+		return length == 0;
+	}
+
+	// takes up to size bytes from the front, splitting a slice if needed
+	std::vector<slice> take(size_t size)
+	{
+		std::vector<slice> result;
+		while (size && parts.size()) {
+			slice & front = parts.front();
+			if (front.size() <= size) {
+				if (front.buffer == open) {
+					open.reset();
+				}
+				size -= front.size();
+				length -= front.size();
+				result.emplace_back(std::move(front));
+				parts.pop_front();
+			} else {
+				result.emplace_back(front.sub(0, size));
+				front = front.sub(size);
+				length -= size;
+				size = 0;
+			}
+		}
+		return result;
+	}
+
+	// puts slices taken from the front back there, in order, as when what they hold could not be sent
+	void untake(std::vector<slice> && taken)
+	{
+		for (auto part = taken.rbegin(); part != taken.rend(); ++ part) {
+			length += part->size();
+			parts.emplace_front(std::move(*part));
+		}
+		taken.clear();
+	}
+
+	// the slices as one vector, copying only if there is more than one or the buffer is shared
+	static std::vector<uint8_t> join(std::vector<slice> && parts)
+	{
+		if (parts.size() == 1) {
+			return std::move(parts.front()).release();
+		}
+		std::vector<uint8_t> result;
+		size_t size = 0;
+		for (auto & part : parts) {
+			size += part.size();
+		}
+		result.reserve(size);
+		for (auto & part : parts) {
+			result.insert(result.end(), part.begin(), part.end());
+		}
+		parts.clear();
+		return result;
+	}
+
+private:
+	std::deque<slice> parts;
+	std::shared_ptr<std::vector<uint8_t>> open;
+	size_t chunksize;
+	size_t length;
+};
+
+// Buffers of one size, reused rather than freed.  A slab taken from the
+// pool goes back to it when the last slice sharing it is gone, even if
+// that is after the pool itself.  Up to keep idle slabs are held.
+class slabpool
+{
+public:
+	slabpool(size_t slabsize, size_t keep = 16)
+	: idle(std::make_shared<slabs>())
+	{
+		idle->slabsize = slabsize;
+		idle->keep = keep;
+	}
+
+	std::shared_ptr<std::vector<uint8_t>> take()
+	{
+		std::vector<uint8_t> * slab = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(idle->mutex);
+			if (idle->free.size()) {
+				slab = idle->free.back().release();
+				idle->free.pop_back();
+			}
+		}
+		if (!slab) {
+			slab = new std::vector<uint8_t>();
+		}
+		// a slab may come back emptied, if a slice released its bytes
+		slab->resize(idle->slabsize);
+		return std::shared_ptr<std::vector<uint8_t>>(slab, [idle = idle](std::vector<uint8_t> * slab) {
+			std::unique_ptr<std::vector<uint8_t>> owned(slab);
+			std::lock_guard<std::mutex> lock(idle->mutex);
+			if (idle->free.size() < idle->keep) {
+				idle->free.emplace_back(std::move(owned));
+			}
+		});
+	}
+
+	size_t slabsize() const
+	{
+		return idle->slabsize;
+	}
+
+private:
+	struct slabs
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<std::vector<uint8_t>>> free;
+		size_t slabsize;
+		size_t keep;
+	};
+	std::shared_ptr<slabs> idle;
+};
+
+}
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "slice.hpp"
+
+namespace sia {
+
+// Appended bytes kept in local files rather than in memory.  The files are
+// segments of segmentsize, named path.0, path.1, ...; appends are written
+// to the page cache, which the kernel writes back in its own time, and read
+// through a mapping, so slices of them queue and upload like any others.
+// A segment's file is removed once the spool has moved past it and no slice
+// of it remains.  Appends may come from many threads.
+//
+// Beside each segment is a journal, path.N.journal, a line of json per
+// record: where each stream's appends landed, and each stream's tail as it
+// is uploaded.  A new journal starts with every tail recorded so far, so the
+// newest always has them all.  A spool opened over the files of one that
+// did not shut down hands what they hold back through leftovers(), so its
+// queued uploads carry on rather than being made again.  Records are
+// written as they happen but not synced, so they outlive the process, not
+// the machine.
+//
+// A segment's file stays until every slice of it is let go, so one slow
+// stream can hold many.  ondisk() tells how much the files take, for the
+// owner to bound.
+class spool
+{
+public:
+	// what an earlier run left of a stream: the last tail it recorded, and the bytes it queued, by stream offset
+	struct leftover
+	{
+		uint64_t offset = 0;
+		nlohmann::json identifiers;
+		std::map<uint64_t, slice> queued;
+	};
+
+	spool(std::string path, size_t segmentsize = 1024*1024*64)
+	: path(std::move(path)), segmentsize(segmentsize), sequence(0), used(0), files(std::make_shared<disk>())
+	{
+		recover();
+	}
+
+	~spool()
+	{
+		// segments may outlive the spool, held by slices
+		std::lock_guard<std::mutex> lock(files->mutex);
+		files->freed = nullptr;
+	}
+
+	// bytes of segment files on disk, including those the spool has moved past that slices still hold
+	uint64_t ondisk() const
+	{
+		return files->bytes;
+	}
+
+	// called from whichever thread lets go of a segment last, once its file is removed
+	void set_freed_callback(std::function<void()> callback)
+	{
+		std::lock_guard<std::mutex> lock(files->mutex);
+		files->freed = std::move(callback);
+	}
+
+	// from here on, segments let go of keep their files and journals, for the next run to recover what they
+	// queued, as when shutting down with uploads still spooled.  the freed callback is not called again.
+	void keep()
+	{
+		std::lock_guard<std::mutex> lock(files->mutex);
+		files->kept = true;
+	}
+
+	// copies data, which is at offset in stream, to the end of the spool, returning the copy as slices of the files
+	std::vector<slice> append(slice const & data, size_t stream, uint64_t offset)
+	{
+		std::vector<slice> result;
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t done = 0;
+		while (done < data.size()) {
+			if (!current || used == segmentsize) {
+				roll();
+			}
+			size_t size = std::min(data.size() - done, segmentsize - used);
+			current->write(data.data() + done, size, used);
+			current->record({{"stream", stream}, {"offset", offset + done}, {"position", used}, {"length", size}});
+			result.emplace_back(current, current->bytes + used, size);
+			used += size;
+			done += size;
+		}
+		return result;
+	}
+
+	// records that stream has been uploaded up to offset, with its tail now at identifiers
+	void sent(size_t stream, uint64_t offset, nlohmann::json const & identifiers)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tails[stream] = {offset, identifiers};
+		if (!current) {
+			roll();
+		}
+		current->record({{"stream", stream}, {"offset", offset}, {"identifiers", identifiers}});
+	}
+
+	// takes what the files of an earlier run held, by stream
+	std::map<size_t, leftover> leftovers()
+	{
+		std::map<size_t, leftover> result;
+		std::lock_guard<std::mutex> lock(mutex);
+		result.swap(recovered);
+		return result;
+	}
+
+private:
+	// what the segment files take, shared with the segments so it is kept up as they go
+	struct disk
+	{
+		std::atomic<uint64_t> bytes{0};
+		std::mutex mutex;
+		std::function<void()> freed;
+		bool kept = false;
+	};
+
+	struct segment
+	{
+		// a new segment, or with existing, one left by an earlier run, to read only
+		segment(std::shared_ptr<disk> files, std::string filename, size_t size, bool existing = false)
+		: filename(std::move(filename)), size(size), journal(-1), bytes(nullptr), files(std::move(files))
+		{
+			fd = ::open(this->filename.c_str(), existing ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (fd == -1) {
+				throw std::runtime_error(this->filename + ": " + strerror(errno));
+			}
+			int result;
+			if (existing) {
+				struct stat status;
+				result = fstat(fd, &status);
+				if (result == 0) {
+					this->size = status.st_size;
+				}
+			} else {
+				result = ftruncate(fd, size);
+				journal = ::open((this->filename + ".journal").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+				if (journal == -1) {
+					result = -1;
+				}
+			}
+			void * map = MAP_FAILED;
+			if (result == 0) {
+				// an empty file is left if an earlier run stopped while creating it
+				map = this->size ? mmap(nullptr, this->size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+			}
+			if (map == MAP_FAILED) {
+				std::string error = strerror(errno);
+				seal();
+				if (!existing) {
+					unlink(this->filename.c_str());
+				}
+				throw std::runtime_error(this->filename + ": " + error);
+			}
+			bytes = (uint8_t *)map;
+			if (existing) {
+				seal();
+			}
+			this->files->bytes += this->size;
+		}
+		~segment()
+		{
+			seal();
+			if (bytes) {
+				munmap(bytes, size);
+			}
+			std::lock_guard<std::mutex> lock(files->mutex);
+			if (files->kept) {
+				return;
+			}
+			// the journal goes first, so a file left on its own has nothing to recover
+			unlink((filename + ".journal").c_str());
+			unlink(filename.c_str());
+			files->bytes -= size;
+			if (files->freed) {
+				files->freed();
+			}
+		}
+		// writing through the descriptor rather than the mapping, as write faults on shared mappings are slow
+		void write(uint8_t const * data, size_t length, size_t offset)
+		{
+			while (length) {
+				ssize_t written = pwrite(fd, data, length, offset);
+				if (written < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					throw std::runtime_error(filename + ": " + strerror(errno));
+				}
+				data += written;
+				offset += written;
+				length -= written;
+			}
+		}
+		void record(nlohmann::json const & entry)
+		{
+			std::string line = entry.dump() + "\n";
+			char const * data = line.data();
+			size_t length = line.size();
+			while (length) {
+				ssize_t written = ::write(journal, data, length);
+				if (written < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					throw std::runtime_error(filename + ".journal: " + strerror(errno));
+				}
+				data += written;
+				length -= written;
+			}
+		}
+		// done writing; the mapping stays for reading
+		void seal()
+		{
+			if (fd != -1) {
+				::close(fd);
+				fd = -1;
+			}
+			if (journal != -1) {
+				::close(journal);
+				journal = -1;
+			}
+		}
+		std::string filename;
+		size_t size;
+		int fd, journal;
+		uint8_t * bytes;
+		std::shared_ptr<disk> files;
+	};
+
+	// moves on to a new segment, starting its journal with the tails, with the mutex held
+	void roll()
+	{
+		if (current) {
+			current->seal();
+		}
+		current = std::make_shared<segment>(files, path + "." + std::to_string(sequence ++), segmentsize);
+		used = 0;
+		for (auto & tail : tails) {
+			current->record({{"stream", tail.first}, {"offset", tail.second.first}, {"identifiers", tail.second.second}});
+		}
+	}
+
+	// reads the journals of the segments an earlier run left, keeping the bytes still to be uploaded
+	void recover()
+	{
+		size_t slash = path.rfind('/');
+		std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+		std::string prefix = path.substr(slash + 1) + ".";
+		std::vector<size_t> numbers;
+		if (DIR * dir = opendir(directory.c_str())) {
+			while (auto entry = readdir(dir)) {
+				std::string name = entry->d_name;
+				if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 && name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+					numbers.push_back(std::stoull(name.substr(prefix.size())));
+				}
+			}
+			closedir(dir);
+		}
+		// the old segments are held until a new journal has their tails
+		std::vector<std::shared_ptr<segment>> old;
+		for (auto number : numbers) {
+			sequence = std::max(sequence, number + 1);
+			old.emplace_back(std::make_shared<segment>(files, path + "." + std::to_string(number), 0, true));
+			auto & segment = old.back();
+			std::ifstream journal(segment->filename + ".journal");
+			std::string line;
+			while (std::getline(journal, line)) {
+				nlohmann::json entry;
+				try {
+					entry = nlohmann::json::parse(line);
+				} catch (nlohmann::detail::parse_error&) {
+					// cut short when the earlier run stopped
+					break;
+				}
+				size_t stream = entry["stream"];
+				uint64_t offset = entry["offset"];
+				if (entry.contains("position")) {
+					size_t position = entry["position"];
+					size_t length = entry["length"];
+					if (position + length <= segment->size) {
+						recovered[stream].queued[offset] = slice(segment, segment->bytes + position, length);
+					}
+				} else if (!tails.count(stream) || offset > tails[stream].first) {
+					tails[stream] = {offset, entry["identifiers"]};
+				}
+			}
+		}
+		for (auto & tail : tails) {
+			recovered[tail.first].offset = tail.second.first;
+			recovered[tail.first].identifiers = tail.second.second;
+		}
+		// bytes that were uploaded are let go, and their segments with them
+		for (auto & stream : recovered) {
+			auto & queued = stream.second.queued;
+			for (auto part = queued.begin(); part != queued.end();) {
+				if (part->first + part->second.size() <= stream.second.offset) {
+					part = queued.erase(part);
+				} else {
+					++ part;
+				}
+			}
+		}
+		if (old.size()) {
+			roll();
+		}
+	}
+
+	std::mutex mutex;
+	std::string path;
+	size_t segmentsize;
+	size_t sequence;
+	std::shared_ptr<segment> current;
+	size_t used;
+	std::map<size_t, std::pair<uint64_t, nlohmann::json>> tails; // by stream, its offset and identifiers
+	std::map<size_t, leftover> recovered;
+	std::shared_ptr<disk> files;
+};
+
+}
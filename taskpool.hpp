@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads running queued tasks.
+// Each thread has its own queue and steals from the others when it runs dry,
+// so tasks queued from within a task tend to stay on the same thread.
+class taskpool
+{
+public:
+	// threads = 0 uses one thread per core
+	taskpool(size_t threads = 0)
+	: pending(0), next(0), running(true)
+	{
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (size_t index = 0; index < threads; ++ index) {
+			queues.emplace_back(new queue());
+		}
+		for (size_t index = 0; index < threads; ++ index) {
+			this->threads.emplace_back(&taskpool::run, this, index);
+		}
+	}
+
+	// runs every queued task before returning
+	~taskpool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			running = false;
+		}
+		wake.notify_all();
+		for (auto & thread : threads) {
+			thread.join();
+		}
+	}
+
+	void submit(std::function<void()> task)
+	{
+		size_t index = current_pool == this ? current_index : (next ++) % queues.size();
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			++ pending;
+		}
+		{
+			std::lock_guard<std::mutex> lock(queues[index]->mutex);
+			queues[index]->tasks.emplace_back(std::move(task));
+		}
+		wake.notify_one();
+	}
+
+	// tasks waiting for a thread
+	size_t queued()
+	{
+		return pending;
+	}
+
+	size_t size()
+	{
+		return threads.size();
+	}
+
+private:
+	struct queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	// newest task from our own queue, else the oldest from another's
+	bool take(size_t index, std::function<void()> & task)
+	{
+		for (size_t offset = 0; offset < queues.size(); ++ offset) {
+			auto & queue = *queues[(index + offset) % queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.tasks.empty()) { continue; }
+			if (offset == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			} else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			-- pending;
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t index)
+	{
+		current_pool = this;
+		current_index = index;
+		std::function<void()> task;
+		while ("running") {
+			if (take(index, task)) {
+				task();
+				task = {};
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			if (!pending && !running) {
+				break;
+			}
+			while (!pending && running) {
+				wake.wait(lock);
+			}
+		}
+		current_pool = nullptr;
+	}
+
+	std::vector<std::unique_ptr<queue>> queues;
+	std::vector<std::thread> threads;
+	std::mutex sleep_mutex;
+	std::condition_variable wake;
+	std::atomic<size_t> pending;
+	std::atomic<size_t> next;
+	bool running;
+
+	static inline thread_local taskpool * current_pool = nullptr;
+	static inline thread_local size_t current_index = 0;
+};
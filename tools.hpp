@@ -1,4 +1,9 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <map>
 #include <sstream>
 #include <getopt.h>
 
@@ -0,0 +1,468 @@
+#pragma once
+
+#include <curl/curl.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "slice.hpp"
+
+namespace sia {
+
+// lets whoever started a transfer abort it once it is no longer needed
+class cancellation
+{
+public:
+	void cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (_cancelled) { return; }
+		_cancelled = true;
+		// called with the lock held, so that unsubscribe() waits for them
+		for (auto & callback : callbacks) {
+			callback.second();
+		}
+		callbacks.clear();
+	}
+
+	bool cancelled()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return _cancelled;
+	}
+
+	// calls callback on cancellation, or right away if already cancelled
+	size_t subscribe(std::function<void()> callback)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (_cancelled) {
+			callback();
+		} else {
+			callbacks[next] = std::move(callback);
+		}
+		return next ++;
+	}
+
+	void unsubscribe(size_t subscription)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		callbacks.erase(subscription);
+	}
+
+private:
+	std::mutex mutex;
+	bool _cancelled = false;
+	size_t next = 0;
+	std::map<size_t, std::function<void()>> callbacks;
+};
+using canceltoken = std::shared_ptr<cancellation>;
+
+// Drives any number of http transfers from a single thread, using libcurl's multi interface.
+// Requests are queued from any thread and complete by calling back from the engine thread,
+// so callbacks should be short and must not wait on other transfers.
+// Connections and tls sessions are kept alive in a shared pool and reused across transfers.
+class transferengine
+{
+public:
+	struct result
+	{
+		CURLcode code = CURLE_OK;
+		long status = 0;
+		std::string error;
+		std::vector<uint8_t> data;
+		std::map<std::string, std::string> headers; // names are lowercased
+		double seconds = 0;
+		double seconds_pretransfer = 0; // until the request could be sent
+		double seconds_starttransfer = 0; // until the first response byte
+
+		bool ok() const
+		{
+			return code == CURLE_OK && status >= 200 && status < 300;
+		}
+	};
+	using callback = std::function<void(result &&)>;
+
+	// one field of a multipart upload.  the data is sent straight from the slices, which the transfer holds until it completes
+	struct part
+	{
+		std::string name;
+		std::string filename;
+		std::vector<slice> data;
+		std::string contenttype;
+	};
+
+	// per-host connection use, to confirm that setup costs are amortized
+	struct connectionstats
+	{
+		size_t transfers = 0;
+		size_t reused = 0; // transfers that needed no new connection
+		size_t handshakes = 0; // tls handshakes performed
+	};
+
+	// connections: how many idle connections to keep alive in total
+	// seconds_idle: connections unused for longer are closed rather than reused
+	transferengine(size_t connections = 16, long seconds_idle = 60)
+	: connections(connections), seconds_idle(seconds_idle)
+	{
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+		multi = curl_multi_init();
+		curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)connections);
+		// all handles are only ever performed from the engine thread, so the share needs no locks
+		share = curl_share_init();
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		running = true;
+		thread = std::thread(&transferengine::run, this);
+	}
+	~transferengine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			running = false;
+		}
+		curl_multi_wakeup(multi);
+		thread.join();
+		for (auto easy : spare) {
+			curl_easy_cleanup(easy);
+		}
+		curl_multi_cleanup(multi);
+		curl_share_cleanup(share);
+		curl_global_cleanup();
+	}
+
+	// GET url, range is an http byte range like "0-1023" or empty for everything.
+	// a cancelled transfer completes with CURLE_ABORTED_BY_CALLBACK.  it starts after delay, as when retrying.
+	void get(std::string const & url, std::string const & range, std::chrono::milliseconds timeout, callback done, canceltoken cancel = {}, std::chrono::milliseconds delay = {})
+	{
+		auto t = new transfer(easy(), url, timeout, std::move(done), std::move(cancel), delay);
+		if (range.size()) {
+			curl_easy_setopt(t->easy, CURLOPT_RANGE, range.c_str());
+		}
+		queue(t);
+	}
+
+	// POST url as multipart/form-data
+	void post(std::string const & url, std::vector<part> const & parts, std::chrono::milliseconds timeout, callback done, canceltoken cancel = {}, std::chrono::milliseconds delay = {})
+	{
+		auto t = new transfer(easy(), url, timeout, std::move(done), std::move(cancel), delay);
+		t->mime = curl_mime_init(t->easy);
+		t->bodies.reserve(parts.size());
+		for (auto & part : parts) {
+			t->bodies.emplace_back(part.data);
+			auto & data = t->bodies.back();
+			auto field = curl_mime_addpart(t->mime);
+			curl_mime_name(field, part.name.c_str());
+			curl_mime_filename(field, part.filename.c_str());
+			curl_mime_type(field, part.contenttype.c_str());
+			curl_mime_data_cb(field, data.size, &body::read, &body::seek, nullptr, &data);
+		}
+		curl_easy_setopt(t->easy, CURLOPT_MIMEPOST, t->mime);
+		queue(t);
+	}
+
+	// number of transfers queued or in flight
+	size_t active()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return pending.size() + inflight.size();
+	}
+
+	std::map<std::string, connectionstats> connection_stats()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+
+private:
+	// a part's data being read out by curl
+	struct body
+	{
+		body(std::vector<slice> const & chunks)
+		: chunks(chunks), size(0), chunk(0), position(0)
+		{
+			for (auto & part : chunks) {
+				size += part.size();
+			}
+		}
+
+		static size_t read(char * buffer, size_t size, size_t count, void * self)
+		{
+			auto & body = *(struct body *)self;
+			size_t total = 0;
+			size *= count;
+			while (total < size && body.chunk < body.chunks.size()) {
+				auto & chunk = body.chunks[body.chunk];
+				size_t length = std::min(size - total, chunk.size() - body.position);
+				memcpy(buffer + total, chunk.data() + body.position, length);
+				total += length;
+				body.position += length;
+				if (body.position == chunk.size()) {
+					++ body.chunk;
+					body.position = 0;
+				}
+			}
+			return total;
+		}
+		// curl rewinds to resend after a redirect
+		static int seek(void * self, curl_off_t offset, int origin)
+		{
+			auto & body = *(struct body *)self;
+			if (origin != SEEK_SET || offset < 0 || (curl_off_t)body.size < offset) {
+				return CURL_SEEKFUNC_CANTSEEK;
+			}
+			body.chunk = 0;
+			body.position = offset;
+			while (body.chunk < body.chunks.size() && body.position >= body.chunks[body.chunk].size()) {
+				body.position -= body.chunks[body.chunk].size();
+				++ body.chunk;
+			}
+			return CURL_SEEKFUNC_OK;
+		}
+
+		std::vector<slice> chunks;
+		curl_off_t size;
+		size_t chunk, position;
+	};
+
+	struct transfer
+	{
+		transfer(CURL * easy, std::string const & url, std::chrono::milliseconds timeout, callback && done, canceltoken && cancel, std::chrono::milliseconds delay)
+		: easy(easy), done(std::move(done)), cancel(std::move(cancel)), due(std::chrono::steady_clock::now() + delay)
+		{
+			errorbuffer[0] = 0;
+			curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(easy, CURLOPT_PRIVATE, this);
+			curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+			curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+			curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)timeout.count());
+			curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, errorbuffer);
+			curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &transfer::write);
+			curl_easy_setopt(easy, CURLOPT_WRITEDATA, this);
+			curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &transfer::header);
+			curl_easy_setopt(easy, CURLOPT_HEADERDATA, this);
+		}
+		~transfer()
+		{
+			if (mime) {
+				curl_mime_free(mime);
+			}
+		}
+
+		static size_t write(char * data, size_t size, size_t count, void * self)
+		{
+			auto & response = ((transfer *)self)->response.data;
+			response.insert(response.end(), (uint8_t *)data, (uint8_t *)data + size * count);
+			return size * count;
+		}
+		static size_t header(char * data, size_t size, size_t count, void * self)
+		{
+			std::string line(data, size * count);
+			auto colon = line.find(':');
+			if (colon != std::string::npos) {
+				std::string name = line.substr(0, colon);
+				for (auto & c : name) { c = std::tolower(c); }
+				auto start = line.find_first_not_of(" \t", colon + 1);
+				auto end = line.find_last_not_of("\r\n");
+				((transfer *)self)->response.headers[name] = start > end ? "" : line.substr(start, end + 1 - start);
+			}
+			return size * count;
+		}
+
+		CURL * easy;
+		curl_mime * mime = nullptr;
+		std::vector<body> bodies;
+		callback done;
+		canceltoken cancel;
+		std::chrono::steady_clock::time_point due; // not started before
+		size_t subscription;
+		result response;
+		char errorbuffer[CURL_ERROR_SIZE];
+	};
+
+	// takes a recycled handle if there is one, so its state need not be rebuilt
+	CURL * easy()
+	{
+		CURL * easy = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.size()) {
+				easy = spare.back();
+				spare.pop_back();
+			}
+		}
+		if (!easy) {
+			easy = curl_easy_init();
+		}
+		curl_easy_setopt(easy, CURLOPT_SHARE, share);
+		curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(easy, CURLOPT_MAXAGE_CONN, seconds_idle);
+		return easy;
+	}
+
+	void queue(transfer * t)
+	{
+		if (t->cancel) {
+			t->subscription = t->cancel->subscribe([this]() {
+				curl_multi_wakeup(multi);
+			});
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending.push_back(t);
+		}
+		curl_multi_wakeup(multi);
+	}
+
+	void finish(transfer * t, CURLcode code)
+	{
+		if (t->cancel) {
+			t->cancel->unsubscribe(t->subscription);
+		}
+		auto & response = t->response;
+		response.code = code;
+		curl_easy_getinfo(t->easy, CURLINFO_RESPONSE_CODE, &response.status);
+		curl_easy_getinfo(t->easy, CURLINFO_TOTAL_TIME, &response.seconds);
+		curl_easy_getinfo(t->easy, CURLINFO_PRETRANSFER_TIME, &response.seconds_pretransfer);
+		curl_easy_getinfo(t->easy, CURLINFO_STARTTRANSFER_TIME, &response.seconds_starttransfer);
+
+		long connects = 0;
+		curl_off_t handshake = 0;
+		char * url = nullptr;
+		curl_easy_getinfo(t->easy, CURLINFO_NUM_CONNECTS, &connects);
+		curl_easy_getinfo(t->easy, CURLINFO_APPCONNECT_TIME_T, &handshake);
+		curl_easy_getinfo(t->easy, CURLINFO_EFFECTIVE_URL, &url);
+		std::string host = url ? url : "";
+		auto hostend = host.find('/', host.find("://") == std::string::npos ? 0 : host.find("://") + 3);
+		host = host.substr(0, hostend);
+		curl_easy_reset(t->easy);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			auto & hoststats = stats[host];
+			++ hoststats.transfers;
+			if (connects == 0 && code != CURLE_COULDNT_CONNECT && code != CURLE_COULDNT_RESOLVE_HOST) {
+				++ hoststats.reused;
+			}
+			if (handshake > 0) {
+				++ hoststats.handshakes;
+			}
+			if (spare.size() < connections) {
+				spare.push_back(t->easy);
+				t->easy = nullptr;
+			}
+		}
+		if (t->easy) {
+			curl_easy_cleanup(t->easy);
+		}
+
+		if (code != CURLE_OK) {
+			response.error = t->errorbuffer[0] ? t->errorbuffer : curl_easy_strerror(code);
+			if (t->cancel && t->cancel->cancelled()) {
+				response.error = "cancelled";
+			}
+		} else if (!response.ok()) {
+			response.error = "HTTP " + std::to_string(response.status) + " " + std::string(response.data.begin(), response.data.end());
+		}
+		auto done = std::move(t->done);
+		auto finished = std::move(t->response);
+		delete t;
+		done(std::move(finished));
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (running || pending.size() || inflight.size()) {
+			if (!running) {
+				// abort everything outstanding so callers are not left waiting
+				pending.insert(pending.end(), inflight.begin(), inflight.end());
+				for (auto t : inflight) {
+					curl_multi_remove_handle(multi, t->easy);
+				}
+				inflight.clear();
+				auto aborted = std::move(pending);
+				pending.clear();
+				lock.unlock();
+				for (auto t : aborted) {
+					finish(t, CURLE_ABORTED_BY_CALLBACK);
+				}
+				lock.lock();
+				continue;
+			}
+			// delayed transfers wait in pending, unless cancelled meanwhile
+			auto now = std::chrono::steady_clock::now();
+			auto wake = now + std::chrono::seconds(1);
+			std::vector<transfer *> waiting;
+			for (auto t : pending) {
+				if (t->due > now && !(t->cancel && t->cancel->cancelled())) {
+					wake = std::min(wake, t->due);
+					waiting.push_back(t);
+					continue;
+				}
+				curl_multi_add_handle(multi, t->easy);
+				inflight.insert(t);
+			}
+			pending = std::move(waiting);
+			std::vector<transfer *> cancelled;
+			for (auto t : inflight) {
+				if (t->cancel && t->cancel->cancelled()) {
+					cancelled.push_back(t);
+				}
+			}
+			for (auto t : cancelled) {
+				curl_multi_remove_handle(multi, t->easy);
+				inflight.erase(t);
+			}
+			lock.unlock();
+			for (auto t : cancelled) {
+				finish(t, CURLE_ABORTED_BY_CALLBACK);
+			}
+
+			int still_running;
+			curl_multi_perform(multi, &still_running);
+
+			CURLMsg * message;
+			int remaining;
+			while ((message = curl_multi_info_read(multi, &remaining))) {
+				if (message->msg != CURLMSG_DONE) { continue; }
+				transfer * t;
+				curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+				CURLcode code = message->data.result;
+				curl_multi_remove_handle(multi, t->easy);
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					inflight.erase(t);
+				}
+				finish(t, code);
+			}
+
+			auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - std::chrono::steady_clock::now());
+			curl_multi_poll(multi, nullptr, 0, std::max(timeout.count(), (long)0), nullptr);
+			lock.lock();
+		}
+	}
+
+	size_t const connections;
+	long const seconds_idle;
+	CURLM * multi;
+	CURLSH * share;
+	std::vector<CURL *> spare;
+	std::map<std::string, connectionstats> stats;
+	bool running;
+	std::mutex mutex;
+	std::vector<transfer *> pending;
+	std::unordered_set<transfer *> inflight;
+	std::thread thread;
+};
+
+}